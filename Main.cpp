@@ -2,8 +2,133 @@
 #include <stdio.h>
 #include <algorithm>
 #include <vector>
+#include <cmath>
 #include <unordered_map>
+#include <memory>
+#include <stdint.h>
+#include <limits.h>
 #include <assert.h>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <new>
+#include <string>
+#include <stdlib.h>
+#include <immintrin.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <malloc.h>
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _MSC_VER
+#define NO_INLINE __declspec(noinline)
+#else
+#define NO_INLINE __attribute__((noinline))
+#endif
+
+// Every allocation is counted, including stb_image's, so the report can say how much memory each stage allocated
+std::atomic<uint64_t> g_bytesAllocated(0);
+std::atomic<uint64_t> g_allocations(0);
+
+inline void CountAllocation (size_t size)
+{
+    g_bytesAllocated.fetch_add(size, std::memory_order_relaxed);
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void* CountedMalloc (size_t size)
+{
+    CountAllocation(size);
+    return malloc(size);
+}
+
+inline void* CountedRealloc (void* memory, size_t size)
+{
+    // the whole new size is counted, since realloc may have had to move the memory
+    CountAllocation(size);
+    return realloc(memory, size);
+}
+
+NO_INLINE void CountedFree (void* memory)
+{
+    // Kept out of line, so the compiler doesn't see the replaced deletes calling free on memory from the replaced news, and warn that they don't match.
+    free(memory);
+}
+
+// All of the replaceable forms of new and delete are replaced, so none of them mix up the C runtime's heap with this one.
+// The aligned forms are left alone, since they always pair with each other.
+void* operator new (size_t size)
+{
+    void* memory = CountedMalloc(size ? size : 1);
+    if (!memory)
+        throw std::bad_alloc();
+    return memory;
+}
+
+void* operator new[] (size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new (size_t size, const std::nothrow_t&) noexcept
+{
+    return CountedMalloc(size ? size : 1);
+}
+
+void* operator new[] (size_t size, const std::nothrow_t&) noexcept
+{
+    return CountedMalloc(size ? size : 1);
+}
+
+void operator delete (void* memory) noexcept
+{
+    CountedFree(memory);
+}
+
+void operator delete[] (void* memory) noexcept
+{
+    CountedFree(memory);
+}
+
+void operator delete (void* memory, size_t) noexcept
+{
+    CountedFree(memory);
+}
+
+void operator delete[] (void* memory, size_t) noexcept
+{
+    CountedFree(memory);
+}
+
+void operator delete (void* memory, const std::nothrow_t&) noexcept
+{
+    CountedFree(memory);
+}
+
+void operator delete[] (void* memory, const std::nothrow_t&) noexcept
+{
+    CountedFree(memory);
+}
+
+#define STBI_MALLOC(size) CountedMalloc(size)
+#define STBI_REALLOC(memory, size) CountedRealloc(memory, size)
+#define STBI_FREE(memory) CountedFree(memory)
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
@@ -14,653 +139,5597 @@
 
 const float c_gamma = 2.2f;
 
-struct SImageInfo
+// How 8 bit image values map to linear values, when loading and writing images
+enum class ETransferFunction
 {
-    std::vector<float>  m_pixels;
-    int m_width = 0;
-    int m_height = 0;
-    int m_channels = 0;
+    Gamma,      // value ^ c_gamma
+    SRGB        // the exact piecewise sRGB curve
+};
+ETransferFunction g_transferFunction = ETransferFunction::Gamma;
 
-    inline float* GetPixel (int x, int y)
+// How linear values are turned back into 8 bit values when writing images
+enum class EEncodeMode
+{
+    Exact,      // evaluate the transfer function for every value
+    Fast        // quantize to c_encodeTableBits bits and look the result up in a table. Can be off by a few values near black.
+};
+EEncodeMode g_encodeMode = EEncodeMode::Exact;
+const int c_encodeTableBits = 12;
+
+// How the source image is stored for the solve to read, and how its gradient is stored for the debug image. The solver itself always works in float.
+// Half and Fixed16 take half the memory, and half the memory traffic to read, for a little precision.
+enum class EPrecision
+{
+    Float,
+    Half,       // IEEE half floats
+    Fixed16     // 16 bit fixed point. Image values are unsigned, and gradients are signed.
+};
+EPrecision g_precision = EPrecision::Float;
+
+// Which gradients the blend keeps.
+// Mixed keeps whichever of the source and destination gradients is stronger, for each pixel, axis and channel, so detail in the destination shows
+// through the flat parts of the source. It's for pasting transparent or thin objects. Only the right hand side changes, so the solve costs the same.
+enum class EGuidance
+{
+    Source,
+    Mixed
+};
+EGuidance g_guidance = EGuidance::Source;
+
+// How rows of PNG files are filtered before they are compressed. PNG lets every row use a different filter.
+enum class EPngFilter
+{
+    None,
+    Sub,
+    Up,
+    Average,
+    Paeth,
+    Adaptive    // try every filter on each row and keep the one with the smallest sum of absolute values
+};
+EPngFilter g_pngFilter = EPngFilter::Adaptive;
+
+// PNG files are compressed at this level, from 0 (stored) to 9 (smallest, slowest).
+// They are written a band of about c_pngBandBytes at a time, so the whole image is never filtered and compressed in memory at once.
+int g_pngLevel = 5;
+const size_t c_pngBandBytes = 256 * 1024;
+
+// Which method PoissonBlend uses to solve the linear system.
+// Dense inverts a numSolvePixels x numSolvePixels matrix, so is only usable for very small masks, but is kept as a reference.
+// SparseCholesky factors the matrix once, which is slow, but makes every solve after that fast. It's best when the mask plan is re-used a lot.
+// RedBlackSOR needs many more iterations than the others, but every iteration is split across all of the threads in g_threadPool.
+// Tiled isn't chosen by g_solver. It's used instead of g_solver for masks bigger than a tile, when the -tilesize option is given.
+enum class ESolver
+{
+    Dense,
+    ConjugateGradient,
+    PreconditionedConjugateGradient,
+    Multigrid,
+    SparseCholesky,
+    RedBlackSOR,
+    Tiled
+};
+const char* c_solverNames[] = { "dense", "cg", "pcg", "multigrid", "cholesky", "sor", "tiled" };
+
+ESolver g_solver = ESolver::PreconditionedConjugateGradient;
+
+// The preconditioner used by the PreconditionedConjugateGradient solver.
+// The diagonal of the matrix is always 4, so Jacobi only scales the residual and won't reduce the iteration count. It's there as a baseline.
+enum class EPreconditioner
+{
+    None,
+    Jacobi,
+    IncompleteCholesky,
+    Multigrid
+};
+
+const EPreconditioner c_preconditioner = EPreconditioner::Multigrid;
+
+// Multigrid settings. Each V-cycle does this many red-black Gauss-Seidel sweeps on the way down and on the way back up.
+// Coarsening stops once a level has fewer solve pixels than c_multigridCoarsestPixels, and that level is solved by smoothing c_multigridCoarsestSweeps times.
+const int c_multigridSmoothingSweeps = 2;
+const size_t c_multigridCoarsestPixels = 16;
+const int c_multigridCoarsestSweeps = 32;
+const int c_multigridMaxCycles = 100;
+
+// Pixels within c_multigridBoundaryDistance of the edge of the solve region get c_multigridBoundarySweeps extra sweeps each time the level is smoothed.
+// The coarse levels can't represent the edge of the region exactly, so the error left there converges slowly without this.
+const int c_multigridBoundaryDistance = 2;
+const int c_multigridBoundarySweeps = 4;
+
+// Nested dissection stops splitting the solve region once a piece has this many pixels or fewer
+const size_t c_nestedDissectionLeafPixels = 64;
+
+// Red-black SOR settings. The solve region is split into tiles of this many rows, which are the units of work given to the threads.
+// The residual is only checked every c_sorCheckInterval iterations since it costs as much as an iteration does.
+const int c_sorTileRows = 16;
+const int c_sorCheckInterval = 16;
+const int c_sorStalledChecks = 32;
+const int c_sorMaxIterations = 20000;
+
+// Tiled solve settings. Each tile is solved along with c_tileOverlap pixels of the tiles around it, and the tiles are coupled by a coarse grid
+// with a pixel for each c_tileCoarseBlock x c_tileCoarseBlock block. Tile sizes are rounded up to a multiple of the block size, and are at least c_tileMinSize.
+// g_tileSize is 0 when tiled solving is off. The right hand side and the solution for the whole mask live in a scratch file in g_scratchDirectory.
+// The source and destination images, and the index image of the mask, are still in memory, so it's the solve that is out of core, not the whole blend.
+const int c_tileOverlap = 16;
+const int c_tileCoarseBlock = 16;
+const int c_tileMinSize = 64;
+const int c_tileStalledSweeps = 4;
+const int c_tileMaxSweeps = 100;
+
+int g_tileSize = 0;
+const char* g_scratchDirectory = ".";
+
+// Benchmark settings. The benchmark blends disc masks from c_benchMinSize pixels across up to the size asked for, doubling the size each time.
+// Each size is run at least c_benchMinSeconds, up to c_benchMaxRuns times, and the fastest time of each stage is reported.
+// The destination has c_benchMargin pixels on every side of the source. The images are written to g_scratchDirectory.
+const int c_benchMinSize = 32;
+const double c_benchMinSeconds = 1.0;
+const int c_benchMaxRuns = 20;
+const int c_benchMargin = 32;
+
+// The iterative solvers stop when the residual is this small, relative to the right hand side, unless the -tolerance option says otherwise.
+// The right hand side is mostly the divergence of the source's gradient, which noise makes big, and it grows with the mask. So a relative residual that
+// looks small can still leave visible error on big masks: 1e-5 left pcg up to 11 levels and multigrid up to 24 levels off the exact solve on a 1.5 megapixel
+// disc of a noisy source, where 1e-7 kept them within a level. That costs about half again as long for pcg and twice as long for multigrid.
+const float c_solveTolerance = 1e-7f;
+
+// The stencil kernels use the widest instruction set the CPU supports, unless the -kernels option says otherwise.
+enum class EInstructionSet
+{
+    Scalar,
+    AVX2,
+    AVX512
+};
+
+// MSVC lets any function use any intrinsics. Other compilers need to be told which functions may use AVX2 and AVX-512.
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+bool CPUSupports (EInstructionSet instructionSet)
+{
+    bool avx2 = false;
+    bool avx512 = false;
+#ifdef _MSC_VER
+    // the OS also has to save the AVX registers on context switches, which is what xgetbv tells us
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    unsigned long long enabledRegisters = osxsave ? _xgetbv(0) : 0;
+    if (maxLeaf >= 7)
     {
-        return &m_pixels[y * m_width * m_channels + x * m_channels];
+        __cpuidex(info, 7, 0);
+        avx2 = avx && (info[1] & (1 << 5)) != 0 && (enabledRegisters & 0x06) == 0x06;
+        avx512 = (info[1] & (1 << 16)) != 0 && (enabledRegisters & 0xe6) == 0xe6;
     }
+#else
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+    avx512 = __builtin_cpu_supports("avx512f");
+#endif
 
-    inline const float* GetPixel(int x, int y) const
+    switch (instructionSet)
     {
-        return &m_pixels[y * m_width * m_channels + x * m_channels];
+        case EInstructionSet::AVX2: return avx2;
+        case EInstructionSet::AVX512: return avx512;
+        default: return true;
     }
+}
+
+// The instruction set the SIMD code uses. It's picked along with the stencil kernels.
+EInstructionSet g_instructionSet = EInstructionSet::Scalar;
 
-    bool Load(const char *fileName, int desiredChannels = 3)
+// the most threads -threads can ask for. It is more than any CPU this runs on has, but a mistyped count can't start millions of them.
+const int c_maxThreads = 1024;
+
+struct SThreadPool
+{
+    // Runs ParallelFor loops on a set of worker threads, plus the calling thread.
+    // Each thread starts with its own contiguous share of the loop, and when it runs out it steals from the end of another thread's share,
+    // so threads that finish early take on work from ones that got the more expensive items.
+    struct SQueue
+    {
+        std::mutex m_mutex;
+        std::deque<size_t> m_items;
+    };
+
+    ~SThreadPool()
+    {
+        Stop();
+    }
+
+    void Start (int numThreads)
+    {
+        Stop();
+        numThreads = std::max(numThreads, 1);
+        for (int index = 0; index < numThreads; ++index)
+            m_queues.emplace_back(new SQueue);
+
+        // the calling thread is thread 0
+        for (int index = 1; index < numThreads; ++index)
+            m_threads.emplace_back(&SThreadPool::WorkerThread, this, index);
+    }
+
+    void Stop ()
     {
-        // load image
-        m_channels = desiredChannels;
-        int channels = 0;
-        stbi_uc* pixels = stbi_load(fileName, &m_width, &m_height, &channels, desiredChannels);
-        if (pixels == nullptr)
         {
-            printf("Could not load file %s\n", fileName);
-            return false;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exit = true;
+        }
+        m_wake.notify_all();
+        for (std::thread& thread : m_threads)
+            thread.join();
+        m_threads.clear();
+        m_queues.clear();
+        m_exit = false;
+    }
+
+    int NumThreads () const
+    {
+        return int(m_threads.size()) + 1;
+    }
+
+    void ParallelFor (size_t count, const std::function<void(size_t)>& function)
+    {
+        if (m_threads.empty() || count <= 1)
+        {
+            for (size_t index = 0; index < count; ++index)
+                function(index);
+            return;
         }
 
-        // convert to float and convert from sRGB to linear
-        m_pixels.resize(m_width*m_height*m_channels);
-        stbi_uc* srcPixel = pixels;
-        for (float& pixel : m_pixels)
         {
-            pixel = float(*srcPixel) / 255.0f;
-            pixel = std::powf(pixel, c_gamma);
-            ++srcPixel;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_function = &function;
+            m_remaining = count;
+
+            // give each thread a contiguous share of the items
+            size_t begin = 0;
+            for (size_t queueIndex = 0; queueIndex < m_queues.size(); ++queueIndex)
+            {
+                size_t end = count * (queueIndex + 1) / m_queues.size();
+                std::lock_guard<std::mutex> queueLock(m_queues[queueIndex]->m_mutex);
+                for (size_t index = begin; index < end; ++index)
+                    m_queues[queueIndex]->m_items.push_back(index);
+                begin = end;
+            }
+
+            m_generation++;
         }
+        m_wake.notify_all();
 
-        // free pixels and return success
-        stbi_image_free(pixels);
-        return true;
+        RunItems(0);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done.wait(lock, [this] () { return m_remaining == 0 && m_numActive == 0; });
+        m_function = nullptr;
+    }
+
+private:
+    bool PopItem (size_t queueIndex, size_t& item)
+    {
+        // take from the front of our own queue, or steal from the back of someone else's
+        for (size_t offset = 0; offset < m_queues.size(); ++offset)
+        {
+            SQueue& queue = *m_queues[(queueIndex + offset) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(queue.m_mutex);
+            if (queue.m_items.empty())
+                continue;
+
+            if (offset == 0)
+            {
+                item = queue.m_items.front();
+                queue.m_items.pop_front();
+            }
+            else
+            {
+                item = queue.m_items.back();
+                queue.m_items.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void RunItems (size_t queueIndex)
+    {
+        size_t item;
+        while (PopItem(queueIndex, item))
+        {
+            (*m_function)(item);
+            if (--m_remaining == 0)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_done.notify_all();
+            }
+        }
+    }
+
+    void WorkerThread (size_t queueIndex)
+    {
+        uint64_t generation = 0;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [&] () { return m_exit || m_generation != generation; });
+                if (m_exit)
+                    return;
+                generation = m_generation;
+                m_numActive++;
+            }
+
+            RunItems(queueIndex);
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_numActive--;
+            }
+            m_done.notify_all();
+        }
     }
+
+    std::vector<std::thread> m_threads;
+    std::vector<std::unique_ptr<SQueue>> m_queues;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    const std::function<void(size_t)>* m_function = nullptr;
+    std::atomic<size_t> m_remaining{ 0 };
+    int m_numActive = 0;
+    uint64_t m_generation = 0;
+    bool m_exit = false;
 };
 
-struct SRect
+SThreadPool g_threadPool;
+
+struct SStopwatch
 {
-    int x1, y1, x2, y2;
+    std::chrono::steady_clock::time_point m_start = std::chrono::steady_clock::now();
+
+    double Lap ()
+    {
+        // the seconds since the stopwatch was made or last lapped, and starts timing again
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - m_start).count();
+        m_start = now;
+        return seconds;
+    }
 };
 
-bool WriteImage (const char *fileName, int width, int height, int numChannels, std::vector<float>& pixels)
+struct SResourceUsage
 {
-    // convert from linear to sRGB, clamp, and convert to uint8.
-    std::vector<stbi_uc> outPixels;
-    outPixels.resize(width*height * numChannels);
-    float* srcPixel = &pixels[0];
-    for (stbi_uc& pixel : outPixels)
+    // What the process has used so far. The difference of two of these is what was used between them, except for the peak resident size,
+    // which is the most memory the process has had resident at any point.
+    double m_wallSeconds = 0.0;
+    double m_cpuSeconds = 0.0;
+    uint64_t m_bytesAllocated = 0;
+    uint64_t m_allocations = 0;
+    uint64_t m_peakResidentBytes = 0;
+
+    static SResourceUsage Now ()
     {
-        float value = std::powf(*srcPixel, 1.0f / c_gamma);
-        if (value < 0.0f)
-            value = 0.0f;
-        else if (value > 1.0f)
-            value = 1.0f;
-        pixel = stbi_uc(value*255.0f);
-        ++srcPixel;
+        SResourceUsage ret;
+        ret.m_wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        ret.m_bytesAllocated = g_bytesAllocated.load(std::memory_order_relaxed);
+        ret.m_allocations = g_allocations.load(std::memory_order_relaxed);
+#ifdef _MSC_VER
+        FILETIME creationTime, exitTime, kernelTime, userTime;
+        if (GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime))
+        {
+            // FILETIMEs count 100 nanosecond intervals
+            uint64_t kernel = (uint64_t(kernelTime.dwHighDateTime) << 32) | kernelTime.dwLowDateTime;
+            uint64_t user = (uint64_t(userTime.dwHighDateTime) << 32) | userTime.dwLowDateTime;
+            ret.m_cpuSeconds = double(kernel + user) * 1.0e-7;
+        }
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            ret.m_peakResidentBytes = counters.PeakWorkingSetSize;
+#else
+        rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+        {
+            ret.m_cpuSeconds = double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1.0e-6;
+#ifdef __APPLE__
+            ret.m_peakResidentBytes = uint64_t(usage.ru_maxrss);
+#else
+            // Linux gives the peak resident size in kilobytes
+            ret.m_peakResidentBytes = uint64_t(usage.ru_maxrss) * 1024;
+#endif
+        }
+#endif
+        return ret;
     }
+};
 
-    return stbi_write_png(fileName, width, height, numChannels, &outPixels[0], numChannels * width) != 0;
-}
+// Why an iterative solver stopped
+enum class ESolveStop
+{
+    Tolerance,  // the residual of every channel got down to the tolerance
+    Stalled,    // float precision kept the residual of a channel from getting any smaller, before it got down to the tolerance
+    Budget,     // it did as many iterations as it was allowed
+    Callback    // the progress callback asked it to stop
+};
+const char* c_solveStopNames[] = { "tolerance", "stalled", "budget", "callback" };
 
-void NaivePaste (const SImageInfo &source, const SImageInfo& mask, const SImageInfo &dest, int pasteX, int pasteY, const char* fileName)
+struct SSolveProgress
 {
-    // copy the destination image to an out image buffer
-    std::vector<float> outPixels;
-    outPixels = dest.m_pixels;
+    // How far along an iterative solve is, after m_iteration iterations. Iterations are V-cycles for multigrid, and sweeps over the tiles for tiled.
+    // The relative residual is the length of a channel's residual over the length of its right hand side. Solvers that solve one channel at a time
+    // have one channel, m_channel. Otherwise m_channel is -1 and there are three.
+    const char* m_solver = nullptr;
+    int m_channel = -1;
+    int m_numChannels = 3;
+    int m_iteration = 0;
+    double m_relativeResidual[3] = { 0.0, 0.0, 0.0 };
 
-    // calculate details of paste, handling negative paste locations and images larger than the destination etc.
-    SRect sourceRect = { 0, 0, source.m_width, source.m_height };
-    SRect destRect = { pasteX, pasteY, pasteX + source.m_width, pasteY + source.m_height };
+    // set on the last progress of a solve that stopped on its own
+    bool m_finished = false;
+    ESolveStop m_stop = ESolveStop::Budget;
+};
 
-    if (destRect.x1 < 0)
+struct SStageReport
+{
+    // the resources a stage used, and the peak resident size of the process when it finished
+    const char* m_name = nullptr;
+    SResourceUsage m_usage;
+};
+
+struct SJobReport
+{
+    std::string m_source;
+    std::string m_mask;
+    int m_pasteX = 0;
+    int m_pasteY = 0;
+    bool m_succeeded = false;
+    std::vector<SStageReport> m_stages;
+    std::vector<SSolveProgress> m_solves;
+};
+
+struct SReport
+{
+    // The stages of each job and how its solves went, for the -report option.
+    // Stages that aren't part of a job, like loading and writing the destination, are kept separately.
+    std::vector<SStageReport> m_stages;
+    std::vector<SJobReport> m_jobs;
+    bool m_inJob = false;
+
+    void BeginJob (const char* source, const char* mask, int pasteX, int pasteY)
     {
-        sourceRect.x1 -= destRect.x1;
-        destRect.x1 = 0;
+        SJobReport job;
+        job.m_source = source;
+        job.m_mask = mask;
+        job.m_pasteX = pasteX;
+        job.m_pasteY = pasteY;
+        m_jobs.push_back(job);
+        m_inJob = true;
     }
 
-    if (destRect.y1 < 0)
+    void EndJob (bool succeeded)
     {
-        sourceRect.y1 -= destRect.y1;
-        destRect.y1 = 0;
+        // a job that's ended because the run failed part way through it is marked as failed
+        if (m_inJob)
+            m_jobs.back().m_succeeded = succeeded;
+        m_inJob = false;
     }
 
-    if (destRect.x2 >= dest.m_width)
+    void AddSolve (const SSolveProgress& solve)
     {
-        int difference = (destRect.x2 - dest.m_width) + 1;
-        sourceRect.x2 -= difference;
-        destRect.x2 = dest.m_width - 1;
+        // how an iterative solve finished. Solves outside of a job, like the benchmark's, aren't kept.
+        if (m_inJob)
+            m_jobs.back().m_solves.push_back(solve);
     }
 
-    if (destRect.y2 >= dest.m_height)
+    void AddStage (const char* name, const SResourceUsage& start, const SResourceUsage& end)
     {
-        int difference = (destRect.y2 - dest.m_height) + 1;
-        sourceRect.y2 -= difference;
-        destRect.y2 = dest.m_height - 1;
+        SStageReport stage;
+        stage.m_name = name;
+        stage.m_usage.m_wallSeconds = end.m_wallSeconds - start.m_wallSeconds;
+        stage.m_usage.m_cpuSeconds = end.m_cpuSeconds - start.m_cpuSeconds;
+        stage.m_usage.m_bytesAllocated = end.m_bytesAllocated - start.m_bytesAllocated;
+        stage.m_usage.m_allocations = end.m_allocations - start.m_allocations;
+        stage.m_usage.m_peakResidentBytes = end.m_peakResidentBytes;
+        (m_inJob ? m_jobs.back().m_stages : m_stages).push_back(stage);
     }
+};
+SReport g_report;
+
+struct SStageTimer
+{
+    // adds a stage to g_report for everything done from when this is made until it goes out of scope
+    const char* m_name;
+    SResourceUsage m_start;
+
+    SStageTimer (const char* name) : m_name(name), m_start(SResourceUsage::Now()) { }
 
-    // naively paste the image
-    int copyWidth = sourceRect.x2 - sourceRect.x1;
-    int copyHeight = sourceRect.y2 - sourceRect.y1;
-    if (copyWidth > 0 && copyHeight > 0)
+    ~SStageTimer ()
     {
-        for (int y = 0; y < copyHeight; ++y)
-        {
-            const float* sourcePixel = source.GetPixel(sourceRect.x1, sourceRect.y1 + y);
-            const float* maskPixel = mask.GetPixel(sourceRect.x1, sourceRect.y1 + y);
-            float* destPixel = &outPixels[((destRect.y1 + y)*dest.m_width + destRect.x1) * 3];
+        g_report.AddStage(m_name, m_start, SResourceUsage::Now());
+    }
+};
 
-            for (int x = 0; x < copyWidth; ++x)
-            {
-                if (*maskPixel > 0.0f)
-                {
-                    memcpy(destPixel, sourcePixel, sizeof(float) * 3);
-                }
+struct SDecodeTables
+{
+    // the linear value of each 8 bit value, for each transfer function
+    float m_tables[2][256];
 
-                sourcePixel += 3;
-                maskPixel += 1;
-                destPixel += 3;
-            }
-            //memcpy(destPixels, sourcePixels, copyWidth * 3 * sizeof(sourcePixels[0]));
+    SDecodeTables ()
+    {
+        for (int value = 0; value < 256; ++value)
+        {
+            float encoded = float(value) / 255.0f;
+            m_tables[int(ETransferFunction::Gamma)][value] = std::powf(encoded, c_gamma);
+            m_tables[int(ETransferFunction::SRGB)][value] = (encoded <= 0.04045f) ? encoded / 12.92f : float(pow((double(encoded) + 0.055) / 1.055, 2.4));
         }
     }
+};
 
-    // write the file
-    if (!WriteImage(fileName, dest.m_width, dest.m_height, dest.m_channels, outPixels))
-        printf(__FUNCTION__ "() error: Could not write %s\n", fileName);
+const float* GetDecodeTable (ETransferFunction transferFunction)
+{
+    static const SDecodeTables s_tables;
+    return s_tables.m_tables[int(transferFunction)];
 }
 
-void InvertMatrixDestructive (const size_t matrixDimension, std::vector<float>& matrix, std::vector<float>& matrixInverted)
+void DecodeValues (const stbi_uc* values, float* linear, size_t count, const float* table)
 {
-    // make sure the matrix and dimensions parameter match up
-    assert(matrix.size() == matrixDimension * matrixDimension);
+    for (size_t index = 0; index < count; ++index)
+        linear[index] = table[values[index]];
+}
 
-    // initialize the inverted matrix to identity
-    matrixInverted.resize(matrix.size(), 0.0f);
+TARGET_AVX2 void DecodeValuesAVX2 (const stbi_uc* values, float* linear, size_t count, const float* table)
+{
+    // widen 8 values to 32 bits, and look them all up in the table with one gather
     size_t index = 0;
-    for (size_t i = 0; i < matrixDimension; ++i)
+    for (; index + 8 <= count; index += 8)
     {
-        matrixInverted[index] = 1.0f;
-        index += matrixDimension + 1;
+        __m256i tableIndices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(values + index)));
+        _mm256_storeu_ps(linear + index, _mm256_i32gather_ps(table, tableIndices, 4));
     }
+    for (; index < count; ++index)
+        linear[index] = table[values[index]];
+}
 
-    // invert matrix
+template <typename T, size_t ALIGNMENT>
+struct SAlignedAllocator
+{
+    // lets std::vector hold memory which starts on an ALIGNMENT byte boundary
+    typedef T value_type;
 
-    // for each column in the matrix...
-    printf("inverting matrix...\n");
-    for (size_t columnIndex = 0; columnIndex < matrixDimension; ++columnIndex)
+    template <typename U>
+    struct rebind
     {
-        printf("\r%i%%", int(100.0f * float(columnIndex) / float(matrixDimension)));
+        typedef SAlignedAllocator<U, ALIGNMENT> other;
+    };
 
-        // find a row that has a non zero value in that row, that isn't a row we already processed
-        size_t rowIndex = columnIndex;
-        size_t rowBegin = rowIndex * matrixDimension;
-        while (rowIndex < matrixDimension && matrix[rowBegin + columnIndex] == 0.0f)
-        {
-            rowBegin += matrixDimension;
-            ++rowIndex;
-        }
-        assert(rowIndex < matrixDimension);
+    SAlignedAllocator () = default;
 
-        // swap that row with the row "columnIndex" in both the matrix and inverted matrix
-        std::swap_ranges(matrix.begin() + rowBegin, matrix.begin() + rowBegin + matrixDimension, matrix.begin() + matrixDimension * columnIndex);
-        std::swap_ranges(matrixInverted.begin() + rowBegin, matrixInverted.begin() + rowBegin + matrixDimension, matrixInverted.begin() + matrixDimension * columnIndex);
-        rowBegin = matrixDimension * columnIndex;
+    template <typename U>
+    SAlignedAllocator (const SAlignedAllocator<U, ALIGNMENT>&) { }
 
-        // scale that row to have a value of 1.0 at that location, in both matrices
-        float scale = matrix[rowBegin + columnIndex];
-        if (scale != 1.0f)
-        {
-            for (size_t index = 0; index < matrixDimension; ++index)
-            {
-                matrix[rowBegin + index] /= scale;
-                matrixInverted[rowBegin + index] /= scale;
-            }
-        }
+    T* allocate (size_t count)
+    {
+        size_t size = (count * sizeof(T) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+        CountAllocation(size);
+#ifdef _MSC_VER
+        void* memory = _aligned_malloc(size, ALIGNMENT);
+#else
+        void* memory = aligned_alloc(ALIGNMENT, size);
+#endif
+        if (!memory)
+            throw std::bad_alloc();
+        return (T*)memory;
+    }
 
-        // for all other rows that are not this row, subtract a multiple of this row to make them have a zero in that column
-        for (size_t rowIndex = 0; rowIndex < matrixDimension; ++rowIndex)
-        {
-            if (rowIndex == columnIndex)
-                continue;
+    void deallocate (T* memory, size_t)
+    {
+#ifdef _MSC_VER
+        _aligned_free(memory);
+#else
+        free(memory);
+#endif
+    }
 
-            size_t otherRowBegin = rowIndex * matrixDimension;
-            float scale = matrix[otherRowBegin + columnIndex];
+    template <typename U>
+    bool operator == (const SAlignedAllocator<U, ALIGNMENT>&) const { return true; }
+
+    template <typename U>
+    bool operator != (const SAlignedAllocator<U, ALIGNMENT>&) const { return false; }
+};
+
+enum class EImageLayout
+{
+    Interleaved,    // the channels of each pixel are next to each other, and rows are packed tightly
+    Planar          // each channel is stored separately, and each row of a channel starts on a c_imageRowAlignment byte boundary
+};
+
+const size_t c_imageRowAlignment = 64;
+
+template <typename T>
+struct SImageChannel
+{
+    // one channel of a planar image, without copying it
+    T* m_pixels = nullptr;
+    int m_width = 0;
+    int m_height = 0;
+    size_t m_pitch = 0;
+
+    T* GetRow (int y) const
+    {
+        return m_pixels + size_t(y) * m_pitch;
+    }
+};
+
+// The types the source image and its gradient can be stored as, and how they convert to and from float.
+// SUNorm16 holds 0 to 1, which is all a linear image value can be. SSNorm16 holds -1 to 1, which is all a gradient can be.
+struct SHalf
+{
+    uint16_t m_bits;
+};
+
+struct SUNorm16
+{
+    uint16_t m_value;
+};
+
+struct SSNorm16
+{
+    int16_t m_value;
+};
+
+inline float LoadValue (float value)
+{
+    return value;
+}
+
+inline void StoreValue (float value, float& out)
+{
+    out = value;
+}
+
+inline float LoadValue (SHalf value)
+{
+    // Fabian Giesen's half to float conversion. The exponent is rebiased, then infinities, NaNs and denormals are fixed up.
+    const uint32_t shiftedExponent = 0x7C00 << 13;
+    uint32_t bits = uint32_t(value.m_bits & 0x7FFF) << 13;
+    uint32_t exponent = bits & shiftedExponent;
+    bits += (127 - 15) << 23;
+    if (exponent == shiftedExponent)
+    {
+        bits += (128 - 16) << 23;
+    }
+    else if (exponent == 0)
+    {
+        const uint32_t magicBits = 113 << 23;
+        float magic, renormalized;
+        bits += 1 << 23;
+        memcpy(&magic, &magicBits, 4);
+        memcpy(&renormalized, &bits, 4);
+        renormalized -= magic;
+        memcpy(&bits, &renormalized, 4);
+    }
+    bits |= uint32_t(value.m_bits & 0x8000) << 16;
+
+    float ret;
+    memcpy(&ret, &bits, 4);
+    return ret;
+}
+
+inline void StoreValue (float value, SHalf& out)
+{
+    // Fabian Giesen's float to half conversion, rounding to nearest even
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    uint32_t sign = bits & 0x80000000u;
+    bits ^= sign;
+
+    uint32_t half;
+    if (bits >= (127u + 16u) << 23)
+    {
+        // too big for a half, so infinity, or NaN if it was NaN
+        half = (bits > 255u << 23) ? 0x7E00 : 0x7C00;
+    }
+    else if (bits < 113u << 23)
+    {
+        // a denormal or zero. Adding this magic number lines the mantissa up at the bottom of the float, rounding it as it goes.
+        const uint32_t magicBits = ((127 - 15) + (23 - 10) + 1) << 23;
+        float magic, sum;
+        memcpy(&magic, &magicBits, 4);
+        memcpy(&sum, &bits, 4);
+        sum += magic;
+        memcpy(&half, &sum, 4);
+        half -= magicBits;
+    }
+    else
+    {
+        uint32_t mantissaOdd = (bits >> 13) & 1;
+        bits += ((15u - 127u) << 23) + 0xFFF;
+        bits += mantissaOdd;
+        half = bits >> 13;
+    }
+    out.m_bits = uint16_t(half | (sign >> 16));
+}
+
+inline float LoadValue (SUNorm16 value)
+{
+    return float(value.m_value) * (1.0f / 65535.0f);
+}
+
+inline void StoreValue (float value, SUNorm16& out)
+{
+    out.m_value = uint16_t(std::min(std::max(value, 0.0f), 1.0f) * 65535.0f + 0.5f);
+}
+
+inline float LoadValue (SSNorm16 value)
+{
+    return float(value.m_value) * (1.0f / 32767.0f);
+}
+
+inline void StoreValue (float value, SSNorm16& out)
+{
+    out.m_value = int16_t(std::floor(std::min(std::max(value, -1.0f), 1.0f) * 32767.0f + 0.5f));
+}
+
+// The precision policies, one for each EPrecision. They say what type the source image and its gradient are stored as.
+// The solve takes the gradient straight from the source image, so only the debug image of the gradient is stored as TGradient.
+struct SFloatPrecision
+{
+    typedef float TImage;
+    typedef float TGradient;
+};
+
+struct SHalfPrecision
+{
+    typedef SHalf TImage;
+    typedef SHalf TGradient;
+};
+
+struct SFixed16Precision
+{
+    typedef SUNorm16 TImage;
+    typedef SSNorm16 TGradient;
+};
+
+struct SRect
+{
+    int x1, y1, x2, y2;
+};
+
+struct SImageInfo
+{
+    std::vector<float, SAlignedAllocator<float, c_imageRowAlignment>> m_pixels;
+    int m_width = 0;
+    int m_height = 0;
+    int m_channels = 0;
+
+    // planar images have m_pitch floats from one row of a channel to the next, and m_pitch * m_height from one channel to the next
+    EImageLayout m_layout = EImageLayout::Interleaved;
+    size_t m_pitch = 0;
+
+    // the part of the image that has changed since it was last encoded, with x2 and y2 exclusive. Empty when x1 >= x2.
+    SRect m_dirty = { 0, 0, 0, 0 };
+
+    void FreePixels ()
+    {
+        // gives the pixel memory back, keeping the size of the image
+        decltype(m_pixels)().swap(m_pixels);
+    }
+
+    void MarkDirty (const SRect& rect)
+    {
+        if (rect.x1 >= rect.x2 || rect.y1 >= rect.y2)
+            return;
+
+        if (m_dirty.x1 >= m_dirty.x2 || m_dirty.y1 >= m_dirty.y2)
+        {
+            m_dirty = rect;
+            return;
+        }
+
+        m_dirty.x1 = std::min(m_dirty.x1, rect.x1);
+        m_dirty.y1 = std::min(m_dirty.y1, rect.y1);
+        m_dirty.x2 = std::max(m_dirty.x2, rect.x2);
+        m_dirty.y2 = std::max(m_dirty.y2, rect.y2);
+    }
+
+    inline float* GetPixel (int x, int y)
+    {
+        assert(m_layout == EImageLayout::Interleaved);
+        return &m_pixels[y * m_width * m_channels + x * m_channels];
+    }
+
+    inline const float* GetPixel(int x, int y) const
+    {
+        assert(m_layout == EImageLayout::Interleaved);
+        return &m_pixels[y * m_width * m_channels + x * m_channels];
+    }
+
+    SImageChannel<float> GetChannel (int channel)
+    {
+        assert(m_layout == EImageLayout::Planar && channel < m_channels);
+        SImageChannel<float> ret;
+        ret.m_pixels = &m_pixels[size_t(channel) * m_pitch * size_t(m_height)];
+        ret.m_width = m_width;
+        ret.m_height = m_height;
+        ret.m_pitch = m_pitch;
+        return ret;
+    }
+
+    SImageChannel<const float> GetChannel (int channel) const
+    {
+        assert(m_layout == EImageLayout::Planar && channel < m_channels);
+        SImageChannel<const float> ret;
+        ret.m_pixels = &m_pixels[size_t(channel) * m_pitch * size_t(m_height)];
+        ret.m_width = m_width;
+        ret.m_height = m_height;
+        ret.m_pitch = m_pitch;
+        return ret;
+    }
+
+    size_t PixelOffset (int x, int y, int channel) const
+    {
+        // where a value is in m_pixels, for either layout
+        if (m_layout == EImageLayout::Planar)
+            return (size_t(channel) * size_t(m_height) + size_t(y)) * m_pitch + size_t(x);
+        return (size_t(y) * size_t(m_width) + size_t(x)) * size_t(m_channels) + size_t(channel);
+    }
+
+    void SetLayout (EImageLayout layout)
+    {
+        if (layout == m_layout)
+            return;
+
+        SImageInfo converted;
+        converted.m_width = m_width;
+        converted.m_height = m_height;
+        converted.m_channels = m_channels;
+        converted.Allocate(layout);
+        converted.m_dirty = m_dirty;
+        for (int channel = 0; channel < m_channels; ++channel)
+        {
+            for (int y = 0; y < m_height; ++y)
+            {
+                for (int x = 0; x < m_width; ++x)
+                    converted.m_pixels[converted.PixelOffset(x, y, channel)] = m_pixels[PixelOffset(x, y, channel)];
+            }
+        }
+        *this = std::move(converted);
+    }
+
+    void Allocate (EImageLayout layout)
+    {
+        // allocates zeroed pixels for the current size and number of channels
+        m_layout = layout;
+        const size_t rowAlignment = c_imageRowAlignment / sizeof(float);
+        m_pitch = (layout == EImageLayout::Planar) ? (size_t(m_width) + rowAlignment - 1) / rowAlignment * rowAlignment : size_t(m_width) * size_t(m_channels);
+        m_pixels.assign(m_pitch * size_t(m_height) * ((layout == EImageLayout::Planar) ? size_t(m_channels) : 1), 0.0f);
+        m_dirty = { 0, 0, m_width, m_height };
+    }
+
+    bool Load(const char *fileName, int desiredChannels = 3, EImageLayout layout = EImageLayout::Interleaved)
+    {
+        // load image
+        m_channels = desiredChannels;
+        int channels = 0;
+        stbi_uc* pixels = stbi_load(fileName, &m_width, &m_height, &channels, desiredChannels);
+        if (pixels == nullptr)
+        {
+            printf("Could not load file %s\n", fileName);
+            return false;
+        }
+
+        Decode(pixels, layout);
+
+        // free pixels and return success
+        stbi_image_free(pixels);
+        return true;
+    }
+
+    bool LoadFromMemory(const uint8_t* data, size_t size, const char *fileName, int desiredChannels = 3, EImageLayout layout = EImageLayout::Interleaved)
+    {
+        // the same as Load, for an image file that has already been read into memory. The file name is only for the error message.
+        m_channels = desiredChannels;
+        int channels = 0;
+        stbi_uc* pixels = stbi_load_from_memory(data, int(size), &m_width, &m_height, &channels, desiredChannels);
+        if (pixels == nullptr)
+        {
+            printf("Could not load file %s\n", fileName);
+            return false;
+        }
+
+        Decode(pixels, layout);
+        stbi_image_free(pixels);
+        return true;
+    }
+
+    void Decode (const stbi_uc* pixels, EImageLayout layout)
+    {
+        // Convert to float and convert from sRGB to linear, putting the values straight into the layout that was asked for.
+        // There are only 256 possible values, so they are looked up in a table. Rows are converted in parallel.
+        Allocate(layout);
+        const float* table = GetDecodeTable(g_transferFunction);
+        const size_t rowSize = size_t(m_width) * size_t(m_channels);
+        g_threadPool.ParallelFor(size_t(m_height), [&] (size_t y)
+        {
+            const stbi_uc* srcRow = pixels + y * rowSize;
+            if (m_layout == EImageLayout::Interleaved)
+            {
+                if (g_instructionSet != EInstructionSet::Scalar)
+                    DecodeValuesAVX2(srcRow, &m_pixels[y * rowSize], rowSize, table);
+                else
+                    DecodeValues(srcRow, &m_pixels[y * rowSize], rowSize, table);
+                return;
+            }
+
+            for (int x = 0; x < m_width; ++x)
+            {
+                for (int channel = 0; channel < m_channels; ++channel)
+                    m_pixels[PixelOffset(x, int(y), channel)] = table[srcRow[x * m_channels + channel]];
+            }
+        });
+    }
+};
+
+template <typename T>
+struct SPlanarImage
+{
+    // A planar copy of an image with its values stored as T, which is one of the types a precision policy can use.
+    // Like a planar SImageInfo, each row of a channel starts on a c_imageRowAlignment byte boundary.
+    std::vector<T, SAlignedAllocator<T, c_imageRowAlignment>> m_pixels;
+    int m_width = 0;
+    int m_height = 0;
+    int m_channels = 0;
+    size_t m_pitch = 0;
+
+    SImageChannel<const T> GetChannel (int channel) const
+    {
+        assert(channel < m_channels);
+        SImageChannel<const T> ret;
+        ret.m_pixels = &m_pixels[size_t(channel) * m_pitch * size_t(m_height)];
+        ret.m_width = m_width;
+        ret.m_height = m_height;
+        ret.m_pitch = m_pitch;
+        return ret;
+    }
+};
+
+template <typename T>
+void MakePlanarImage (const SImageInfo& image, SPlanarImage<T>& planar)
+{
+    // rows are converted in parallel
+    const size_t rowAlignment = c_imageRowAlignment / sizeof(T);
+    planar.m_width = image.m_width;
+    planar.m_height = image.m_height;
+    planar.m_channels = image.m_channels;
+    planar.m_pitch = (size_t(image.m_width) + rowAlignment - 1) / rowAlignment * rowAlignment;
+    planar.m_pixels.assign(planar.m_pitch * size_t(image.m_height) * size_t(image.m_channels), T());
+    g_threadPool.ParallelFor(size_t(image.m_height), [&] (size_t y)
+    {
+        for (int channel = 0; channel < image.m_channels; ++channel)
+        {
+            T* row = &planar.m_pixels[(size_t(channel) * size_t(image.m_height) + y) * planar.m_pitch];
+            for (int x = 0; x < image.m_width; ++x)
+                StoreValue(image.m_pixels[image.PixelOffset(x, int(y), channel)], row[x]);
+        }
+    });
+}
+
+stbi_uc EncodeValue (float linear, ETransferFunction transferFunction)
+{
+    // convert from linear to sRGB, clamp, and convert to uint8.
+    float value = (transferFunction == ETransferFunction::SRGB)
+        ? ((linear <= 0.0031308f) ? linear * 12.92f : 1.055f * std::powf(linear, 1.0f / 2.4f) - 0.055f)
+        : std::powf(linear, 1.0f / c_gamma);
+    if (value < 0.0f)
+        value = 0.0f;
+    else if (value > 1.0f)
+        value = 1.0f;
+    return stbi_uc(value*255.0f);
+}
+
+struct SEncodeTables
+{
+    // The 8 bit value of each quantized linear value, for each transfer function.
+    // They are stored as 32 bit ints so that AVX2 can gather from them.
+    int32_t m_tables[2][1 << c_encodeTableBits];
+
+    SEncodeTables ()
+    {
+        const int maxIndex = (1 << c_encodeTableBits) - 1;
+        for (int index = 0; index <= maxIndex; ++index)
+        {
+            float linear = float(index) / float(maxIndex);
+            m_tables[int(ETransferFunction::Gamma)][index] = EncodeValue(linear, ETransferFunction::Gamma);
+            m_tables[int(ETransferFunction::SRGB)][index] = EncodeValue(linear, ETransferFunction::SRGB);
+        }
+    }
+};
+
+const int32_t* GetEncodeTable (ETransferFunction transferFunction)
+{
+    static const SEncodeTables s_tables;
+    return s_tables.m_tables[int(transferFunction)];
+}
+
+void EncodeValuesFast (const float* linear, stbi_uc* values, size_t count, const int32_t* table)
+{
+    // clamp to [0,1] (with NaN going to 0), then round to the nearest table entry
+    const float scale = float((1 << c_encodeTableBits) - 1);
+    for (size_t index = 0; index < count; ++index)
+    {
+        float value = linear[index] > 0.0f ? linear[index] : 0.0f;
+        value = value < 1.0f ? value : 1.0f;
+        values[index] = stbi_uc(table[int(value * scale + 0.5f)]);
+    }
+}
+
+TARGET_AVX2 void EncodeValuesFastAVX2 (const float* linear, stbi_uc* values, size_t count, const int32_t* table)
+{
+    // the same as EncodeValuesFast, 8 values at a time
+    const __m256 scale = _mm256_set1_ps(float((1 << c_encodeTableBits) - 1));
+    size_t index = 0;
+    for (; index + 8 <= count; index += 8)
+    {
+        __m256 value = _mm256_max_ps(_mm256_loadu_ps(linear + index), _mm256_setzero_ps());
+        value = _mm256_min_ps(value, _mm256_set1_ps(1.0f));
+        __m256i tableIndices = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(value, scale), _mm256_set1_ps(0.5f)));
+        __m256i encoded = _mm256_i32gather_epi32(table, tableIndices, 4);
+
+        // pack the 32 bit results down to bytes
+        __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(encoded), _mm256_extracti128_si256(encoded, 1));
+        _mm_storel_epi64((__m128i*)(values + index), _mm_packus_epi16(words, words));
+    }
+    EncodeValuesFast(linear + index, values + index, count - index, table);
+}
+
+// Deflate, as used by zlib streams in PNG files. Matches are found with hash chains, and written with the fixed huffman codes.
+const int c_deflateWindowSize = 32768;
+const int c_deflateHashBits = 15;
+const int c_deflateMinMatch = 3;
+const int c_deflateMaxMatch = 258;
+
+struct SDeflateLevel
+{
+    // these are the same as zlib's settings for each level
+    int m_maxChain;     // how many earlier positions with the same hash are checked for a match
+    int m_goodLength;   // when looking for a longer match than one this long, only a quarter of the chain is checked
+    int m_niceLength;   // stop looking for a longer match once one this long has been found
+    int m_maxLazy;      // matches shorter than this are only used if the next position doesn't have a longer match. 0 never checks.
+};
+
+const SDeflateLevel c_deflateLevels[10] =
+{
+    { 0, 0, 0, 0 }, { 4, 4, 8, 0 }, { 8, 4, 16, 0 }, { 32, 4, 32, 0 }, { 16, 4, 16, 4 },
+    { 32, 8, 32, 16 }, { 128, 8, 128, 16 }, { 256, 8, 128, 32 }, { 1024, 32, 258, 128 }, { 4096, 32, 258, 258 }
+};
+
+struct SHuffmanCode
+{
+    // the code is bit reversed, ready to be written least significant bit first
+    uint16_t m_code;
+    uint8_t m_length;
+};
+
+struct SDeflateTables
+{
+    SHuffmanCode m_literals[288];
+    SHuffmanCode m_distances[30];
+    uint16_t m_lengthBase[29];
+    uint8_t m_lengthExtraBits[29];
+    uint16_t m_distanceBase[30];
+    uint8_t m_distanceExtraBits[30];
+    uint8_t m_lengthSymbol[c_deflateMaxMatch + 1];        // length code - 257 for each match length
+    uint8_t m_distanceSymbol[c_deflateWindowSize];        // distance code for each distance - 1
+
+    static uint16_t ReverseBits (int code, int length)
+    {
+        int ret = 0;
+        for (int bit = 0; bit < length; ++bit)
+            ret |= ((code >> bit) & 1) << (length - 1 - bit);
+        return uint16_t(ret);
+    }
+
+    SDeflateTables ()
+    {
+        for (int symbol = 0; symbol < 288; ++symbol)
+        {
+            int code, length;
+            if (symbol < 144)
+            {
+                code = 0x30 + symbol;
+                length = 8;
+            }
+            else if (symbol < 256)
+            {
+                code = 0x190 + symbol - 144;
+                length = 9;
+            }
+            else if (symbol < 280)
+            {
+                code = symbol - 256;
+                length = 7;
+            }
+            else
+            {
+                code = 0xC0 + symbol - 280;
+                length = 8;
+            }
+            m_literals[symbol] = { ReverseBits(code, length), uint8_t(length) };
+        }
+
+        for (int symbol = 0; symbol < 30; ++symbol)
+            m_distances[symbol] = { ReverseBits(symbol, 5), 5 };
+
+        static const uint16_t lengthBase[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+        static const uint8_t lengthExtraBits[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+        static const uint16_t distanceBase[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+        static const uint8_t distanceExtraBits[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+        memcpy(m_lengthBase, lengthBase, sizeof(lengthBase));
+        memcpy(m_lengthExtraBits, lengthExtraBits, sizeof(lengthExtraBits));
+        memcpy(m_distanceBase, distanceBase, sizeof(distanceBase));
+        memcpy(m_distanceExtraBits, distanceExtraBits, sizeof(distanceExtraBits));
+
+        // 258 fits in the range of code 284 too, but has its own code, which comes last
+        for (int symbol = 0; symbol < 29; ++symbol)
+        {
+            for (int length = lengthBase[symbol]; length < lengthBase[symbol] + (1 << lengthExtraBits[symbol]) && length <= c_deflateMaxMatch; ++length)
+                m_lengthSymbol[length] = uint8_t(symbol);
+        }
+
+        for (int symbol = 0; symbol < 30; ++symbol)
+        {
+            for (int distance = distanceBase[symbol]; distance < distanceBase[symbol] + (1 << distanceExtraBits[symbol]); ++distance)
+                m_distanceSymbol[distance - 1] = uint8_t(symbol);
+        }
+    }
+};
+
+const SDeflateTables& GetDeflateTables ()
+{
+    static const SDeflateTables s_tables;
+    return s_tables;
+}
+
+struct SBitWriter
+{
+    // appends bits to a byte buffer least significant bit first, the way deflate wants them
+    std::vector<uint8_t>& m_out;
+    uint64_t m_bits = 0;
+    int m_count = 0;
+
+    SBitWriter (std::vector<uint8_t>& out) : m_out(out) { }
+
+    void Add (uint32_t bits, int count)
+    {
+        m_bits |= uint64_t(bits) << m_count;
+        m_count += count;
+        while (m_count >= 8)
+        {
+            m_out.push_back(uint8_t(m_bits));
+            m_bits >>= 8;
+            m_count -= 8;
+        }
+    }
+
+    void AddCode (const SHuffmanCode& code)
+    {
+        Add(code.m_code, code.m_length);
+    }
+
+    void Align ()
+    {
+        if (m_count > 0)
+            Add(0, 8 - m_count);
+    }
+
+    void AddEmptyStoredBlock (bool final)
+    {
+        // a stored block with no data. It ends on a byte boundary, so anything can be appended after it.
+        Add(final ? 1 : 0, 3);
+        Align();
+        Add(0, 16);
+        Add(0xFFFF, 16);
+    }
+};
+
+inline int32_t CountTrailingZeros (uint64_t value)
+{
+    // value must not be zero
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long bit;
+    _BitScanForward64(&bit, value);
+    return int32_t(bit);
+#elif defined(_MSC_VER)
+    unsigned long bit;
+    if (_BitScanForward(&bit, uint32_t(value)))
+        return int32_t(bit);
+    _BitScanForward(&bit, uint32_t(value >> 32));
+    return int32_t(bit) + 32;
+#else
+    return int32_t(__builtin_ctzll(value));
+#endif
+}
+
+inline int32_t MatchLength (const uint8_t* a, const uint8_t* b, int32_t maxLength)
+{
+    // how many bytes are the same at the start of a and b, comparing 8 at a time
+    int32_t length = 0;
+    while (length + 8 <= maxLength)
+    {
+        uint64_t valueA, valueB;
+        memcpy(&valueA, a + length, 8);
+        memcpy(&valueB, b + length, 8);
+        uint64_t difference = valueA ^ valueB;
+        if (difference != 0)
+        {
+            return length + CountTrailingZeros(difference) / 8;
+        }
+        length += 8;
+    }
+    while (length < maxLength && a[length] == b[length])
+        ++length;
+    return length;
+}
+
+inline uint32_t DeflateHash (const uint8_t* data)
+{
+    uint32_t value = uint32_t(data[0]) | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16);
+    return (value * 2654435761u) >> (32 - c_deflateHashBits);
+}
+
+void DeflateBand (const uint8_t* data, size_t start, size_t end, int level, std::vector<uint8_t>& out)
+{
+    // Appends data[start, end) to out as deflate blocks, ending with an empty stored block so the output ends on a byte boundary,
+    // ready for more blocks. Matches can reach back into data[0, start), which should be the data that came before it in the stream.
+    // Level 0 stores the data. The others use the fixed huffman codes, and search further for matches the higher they are.
+    SBitWriter bits(out);
+    if (level <= 0)
+    {
+        for (size_t blockStart = start; blockStart < end; )
+        {
+            size_t blockSize = std::min(end - blockStart, size_t(65535));
+            bits.Add(0, 3);
+            bits.Align();
+            bits.Add(uint32_t(blockSize), 16);
+            bits.Add(uint32_t(~blockSize) & 0xFFFF, 16);
+            out.insert(out.end(), data + blockStart, data + blockStart + blockSize);
+            blockStart += blockSize;
+        }
+        bits.AddEmptyStoredBlock(false);
+        return;
+    }
+
+    const SDeflateTables& tables = GetDeflateTables();
+    const SDeflateLevel& settings = c_deflateLevels[std::min(level, 9)];
+
+    // positions are relative to the start of the window, which is as far back as a match can reach
+    const size_t windowStart = (start > size_t(c_deflateWindowSize)) ? start - c_deflateWindowSize : 0;
+    const uint8_t* window = data + windowStart;
+    const int32_t total = int32_t(end - windowStart);
+    std::vector<int32_t> head(size_t(1) << c_deflateHashBits, -1);
+    std::vector<int32_t> previous(c_deflateWindowSize, -1);
+
+    auto Insert = [&] (int32_t position)
+    {
+        if (position + c_deflateMinMatch > total)
+            return;
+        uint32_t hash = DeflateHash(&window[position]);
+        previous[position & (c_deflateWindowSize - 1)] = head[hash];
+        head[hash] = position;
+    };
+
+    auto FindMatch = [&] (int32_t position, int32_t previousLength, int32_t& distance) -> int32_t
+    {
+        // returns the length of the longest match found, or 0 if there isn't one longer than previousLength
+        int32_t maxLength = std::min(total - position, int32_t(c_deflateMaxMatch));
+        if (maxLength < c_deflateMinMatch)
+            return 0;
+
+        const uint8_t* current = &window[position];
+        int32_t bestLength = std::max(previousLength, int32_t(c_deflateMinMatch - 1));
+        if (bestLength >= maxLength)
+            return 0;
+        int32_t candidate = head[DeflateHash(current)];
+        int chain = (previousLength >= settings.m_goodLength) ? settings.m_maxChain / 4 : settings.m_maxChain;
+        for (; candidate >= 0 && position - candidate <= c_deflateWindowSize && chain > 0; --chain)
+        {
+            const uint8_t* match = &window[candidate];
+            if (match[bestLength] == current[bestLength] && match[0] == current[0])
+            {
+                int32_t length = MatchLength(match, current, maxLength);
+                if (length > bestLength)
+                {
+                    bestLength = length;
+                    distance = position - candidate;
+                    if (length >= std::min(maxLength, int32_t(settings.m_niceLength)))
+                        break;
+                }
+            }
+
+            // chains only ever go backwards. Anything else is an entry that has been overwritten by a newer position.
+            int32_t next = previous[candidate & (c_deflateWindowSize - 1)];
+            if (next >= candidate)
+                break;
+            candidate = next;
+        }
+        return (bestLength > std::max(previousLength, int32_t(c_deflateMinMatch - 1))) ? bestLength : 0;
+    };
+
+    for (int32_t position = 0; position < int32_t(start - windowStart); ++position)
+        Insert(position);
+
+    // one fixed huffman block, that isn't the final block
+    bits.Add(0, 1);
+    bits.Add(1, 2);
+
+    // the lazy match check finds the match at the next position, which is kept for the next time around if it gets used
+    int32_t nextPosition = -1;
+    int32_t nextLength = 0;
+    int32_t nextDistance = 0;
+    for (int32_t position = int32_t(start - windowStart); position < total; )
+    {
+        int32_t distance = 0;
+        int32_t length = (position == nextPosition) ? nextLength : FindMatch(position, 0, distance);
+        if (position == nextPosition)
+            distance = nextDistance;
+        Insert(position);
+
+        if (length > 0 && length < settings.m_maxLazy)
+        {
+            nextPosition = position + 1;
+            nextLength = FindMatch(nextPosition, length, nextDistance);
+            if (nextLength > length)
+                length = 0;
+        }
+
+        if (length == 0)
+        {
+            bits.AddCode(tables.m_literals[window[position]]);
+            ++position;
+            continue;
+        }
+
+        int lengthSymbol = tables.m_lengthSymbol[length];
+        bits.AddCode(tables.m_literals[257 + lengthSymbol]);
+        bits.Add(uint32_t(length - tables.m_lengthBase[lengthSymbol]), tables.m_lengthExtraBits[lengthSymbol]);
+        int distanceSymbol = tables.m_distanceSymbol[distance - 1];
+        bits.AddCode(tables.m_distances[distanceSymbol]);
+        bits.Add(uint32_t(distance - tables.m_distanceBase[distanceSymbol]), tables.m_distanceExtraBits[distanceSymbol]);
+
+        for (int32_t index = 1; index < length; ++index)
+            Insert(position + index);
+        position += length;
+    }
+
+    // end of block
+    bits.AddCode(tables.m_literals[256]);
+    bits.AddEmptyStoredBlock(false);
+}
+
+uint32_t Adler32 (uint32_t adler, const uint8_t* data, size_t size)
+{
+    // 5552 is the most bytes that can be summed before s2 could overflow
+    uint32_t s1 = adler & 0xFFFF;
+    uint32_t s2 = adler >> 16;
+    while (size > 0)
+    {
+        size_t blockSize = std::min(size, size_t(5552));
+        for (size_t index = 0; index < blockSize; ++index)
+        {
+            s1 += data[index];
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+        data += blockSize;
+        size -= blockSize;
+    }
+    return (s2 << 16) | s1;
+}
+
+uint32_t Adler32Combine (uint32_t adler1, uint32_t adler2, size_t size2)
+{
+    // the adler32 of two pieces of data one after the other, from the adler32 of each, and the size of the second. This is zlib's adler32_combine.
+    const uint32_t base = 65521;
+    uint32_t remainder = uint32_t(size2 % base);
+    uint32_t s1 = adler1 & 0xFFFF;
+    uint32_t s2 = uint32_t((uint64_t(remainder) * s1) % base);
+    s1 += (adler2 & 0xFFFF) + base - 1;
+    s2 += (adler1 >> 16) + (adler2 >> 16) + base - remainder;
+    if (s1 >= base)
+        s1 -= base;
+    if (s1 >= base)
+        s1 -= base;
+    if (s2 >= base * 2)
+        s2 -= base * 2;
+    if (s2 >= base)
+        s2 -= base;
+    return (s2 << 16) | s1;
+}
+
+inline int PaethPredictor (int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return (pb <= pc) ? b : c;
+}
+
+void FilterRow (const uint8_t* row, const uint8_t* prior, size_t rowBytes, size_t bytesPerPixel, EPngFilter filter, uint8_t* out)
+{
+    // Writes the filter type byte and then the filtered row to out. prior is the row above, which is all zeros for the first row.
+    // Adaptive filters the row every way there is, and keeps whichever has the smallest sum of absolute values, like stb_image_write does.
+    if (filter == EPngFilter::Adaptive)
+    {
+        EPngFilter bestFilter = EPngFilter::None;
+        int bestCost = INT_MAX;
+        for (int type = int(EPngFilter::None); type <= int(EPngFilter::Paeth); ++type)
+        {
+            FilterRow(row, prior, rowBytes, bytesPerPixel, EPngFilter(type), out);
+            int cost = 0;
+            for (size_t index = 1; index <= rowBytes; ++index)
+                cost += abs(int(int8_t(out[index])));
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestFilter = EPngFilter(type);
+            }
+        }
+        if (bestFilter != EPngFilter::Paeth)
+            FilterRow(row, prior, rowBytes, bytesPerPixel, bestFilter, out);
+        return;
+    }
+
+    out[0] = uint8_t(filter);
+    for (size_t index = 0; index < rowBytes; ++index)
+    {
+        int left = (index >= bytesPerPixel) ? row[index - bytesPerPixel] : 0;
+        int up = prior[index];
+        int upLeft = (index >= bytesPerPixel) ? prior[index - bytesPerPixel] : 0;
+        int predicted = 0;
+        switch (filter)
+        {
+            case EPngFilter::Sub: predicted = left; break;
+            case EPngFilter::Up: predicted = up; break;
+            case EPngFilter::Average: predicted = (left + up) >> 1; break;
+            case EPngFilter::Paeth: predicted = PaethPredictor(left, up, upLeft); break;
+            default: break;
+        }
+        out[index + 1] = uint8_t(row[index] - predicted);
+    }
+}
+
+bool ParsePngFilter (const char* name, EPngFilter& filter)
+{
+    // filter is only changed when name is one of the filter names
+    static const char* names[] = { "none", "sub", "up", "average", "paeth", "adaptive" };
+    for (int index = 0; index <= int(EPngFilter::Adaptive); ++index)
+    {
+        if (!strcmp(name, names[index]))
+        {
+            filter = EPngFilter(index);
+            return true;
+        }
+    }
+
+    printf("invalid value %s for -pngfilter, which must be one of", name);
+    for (int index = 0; index <= int(EPngFilter::Adaptive); ++index)
+        printf("%s %s", (index == 0) ? "" : (index == int(EPngFilter::Adaptive)) ? " or" : ",", names[index]);
+    printf("\n");
+    return false;
+}
+
+struct SPngWriter
+{
+    // Writes a PNG file a band of rows at a time. Each band is filtered as it comes in, with its rows filtered in parallel.
+    // Filtered bands are queued up until there is one for each thread, and then they are all compressed in parallel with DeflateBand,
+    // and written in order, each as its own IDAT chunk. This is how pigz does it: every band ends on a byte boundary so the compressed bands
+    // can be stitched together into one zlib stream, and each band can still use matches from the end of the band before it.
+    FILE* m_file = nullptr;
+    bool m_failed = false;
+    int m_width = 0;
+    int m_height = 0;
+    int m_channels = 0;
+    size_t m_rowBytes = 0;
+    int m_rowsWritten = 0;
+    uint32_t m_adler = 1;
+    std::vector<uint8_t> m_priorRow;
+    std::vector<uint8_t> m_filtered;        // the window of filtered data before the queued bands, then the queued bands
+    std::vector<size_t> m_bandEnds;         // where each queued band ends in m_filtered. The first starts at m_windowSize.
+    size_t m_windowSize = 0;
+    std::vector<std::vector<uint8_t>> m_chunks;
+    std::vector<uint32_t> m_bandAdlers;
+    bool m_headerWritten = false;
+
+    ~SPngWriter ()
+    {
+        if (m_file)
+            fclose(m_file);
+    }
+
+    int BandRows () const
+    {
+        // how many rows WriteRows should be given at a time
+        return std::max(int(c_pngBandBytes / m_rowBytes), 1);
+    }
+
+    static void BeginChunk (std::vector<uint8_t>& chunk, const char* type)
+    {
+        // the length is filled in by FinishChunk
+        chunk.assign(8, 0);
+        memcpy(&chunk[4], type, 4);
+    }
+
+    static void FinishChunk (std::vector<uint8_t>& chunk)
+    {
+        uint32_t length = uint32_t(chunk.size() - 8);
+        uint32_t crc = stbiw__crc32(&chunk[4], int(length + 4));
+        WriteBigEndian(&chunk[0], length);
+        chunk.resize(chunk.size() + 4);
+        WriteBigEndian(&chunk[chunk.size() - 4], crc);
+    }
+
+    void WriteChunk (const std::vector<uint8_t>& chunk)
+    {
+        if (fwrite(&chunk[0], 1, chunk.size(), m_file) != chunk.size())
+            m_failed = true;
+    }
+
+    static void WriteBigEndian (uint8_t* out, uint32_t value)
+    {
+        out[0] = uint8_t(value >> 24);
+        out[1] = uint8_t(value >> 16);
+        out[2] = uint8_t(value >> 8);
+        out[3] = uint8_t(value);
+    }
+
+    bool Open (const char* fileName, int width, int height, int channels)
+    {
+        static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        static const uint8_t colorTypes[5] = { 0, 0, 4, 2, 6 };
+        assert(channels >= 1 && channels <= 4);
+
+        // PNG has no empty images, and BandRows needs a row to have bytes in it
+        if (width <= 0 || height <= 0)
+        {
+            printf(__FUNCTION__ "() error: %s would be %i x %i, and a PNG can't be empty\n", fileName, width, height);
+            return false;
+        }
+
+        m_file = fopen(fileName, "wb");
+        if (!m_file)
+            return false;
+
+        m_width = width;
+        m_height = height;
+        m_channels = channels;
+        m_rowBytes = size_t(width) * size_t(channels);
+        m_priorRow.assign(m_rowBytes, 0);
+        if (fwrite(signature, 1, sizeof(signature), m_file) != sizeof(signature))
+            m_failed = true;
+
+        // 8 bits per channel, no interlacing
+        std::vector<uint8_t> chunk;
+        BeginChunk(chunk, "IHDR");
+        chunk.resize(8 + 13);
+        WriteBigEndian(&chunk[8], uint32_t(width));
+        WriteBigEndian(&chunk[12], uint32_t(height));
+        chunk[16] = 8;
+        chunk[17] = colorTypes[channels];
+        chunk[18] = 0;
+        chunk[19] = 0;
+        chunk[20] = 0;
+        FinishChunk(chunk);
+        WriteChunk(chunk);
+        return !m_failed;
+    }
+
+    void WriteRows (const uint8_t* rows, int numRows)
+    {
+        // the rows are tightly packed, and come in order from the top of the image
+        assert(m_rowsWritten + numRows <= m_height);
+        const size_t filteredRowBytes = m_rowBytes + 1;
+        const size_t bandStart = m_filtered.size();
+        m_filtered.resize(bandStart + size_t(numRows) * filteredRowBytes);
+        g_threadPool.ParallelFor(size_t(numRows), [&] (size_t row)
+        {
+            const uint8_t* prior = (row == 0) ? &m_priorRow[0] : rows + (row - 1) * m_rowBytes;
+            FilterRow(rows + row * m_rowBytes, prior, m_rowBytes, size_t(m_channels), g_pngFilter, &m_filtered[bandStart + row * filteredRowBytes]);
+        });
+        m_bandEnds.push_back(m_filtered.size());
+        memcpy(&m_priorRow[0], rows + size_t(numRows - 1) * m_rowBytes, m_rowBytes);
+        m_rowsWritten += numRows;
+
+        if (int(m_bandEnds.size()) >= g_threadPool.NumThreads())
+            CompressBands();
+    }
+
+    void CompressBands ()
+    {
+        // Compresses the queued bands in parallel, then writes them out in order.
+        // The zlib header goes at the start of the first IDAT chunk. The compression level in it is only informational.
+        if (m_bandEnds.empty())
+            return;
+
+        const bool first = !m_headerWritten;
+        m_headerWritten = true;
+        const size_t numBands = m_bandEnds.size();
+        m_chunks.resize(numBands);
+        m_bandAdlers.resize(numBands);
+        g_threadPool.ParallelFor(numBands, [&] (size_t band)
+        {
+            const size_t bandStart = (band == 0) ? m_windowSize : m_bandEnds[band - 1];
+            std::vector<uint8_t>& chunk = m_chunks[band];
+            BeginChunk(chunk, "IDAT");
+            if (first && band == 0)
+            {
+                chunk.push_back(0x78);
+                chunk.push_back((g_pngLevel <= 1) ? 0x01 : (g_pngLevel <= 5) ? 0x5E : (g_pngLevel == 6) ? 0x9C : 0xDA);
+            }
+            DeflateBand(&m_filtered[0], bandStart, m_bandEnds[band], g_pngLevel, chunk);
+            FinishChunk(chunk);
+            m_bandAdlers[band] = Adler32(1, &m_filtered[bandStart], m_bandEnds[band] - bandStart);
+        });
+
+        for (size_t band = 0; band < numBands; ++band)
+        {
+            const size_t bandStart = (band == 0) ? m_windowSize : m_bandEnds[band - 1];
+            m_adler = Adler32Combine(m_adler, m_bandAdlers[band], m_bandEnds[band] - bandStart);
+            WriteChunk(m_chunks[band]);
+        }
+
+        // keep the end of the filtered data for the next bands to match against
+        if (m_filtered.size() > size_t(c_deflateWindowSize))
+            m_filtered.erase(m_filtered.begin(), m_filtered.end() - c_deflateWindowSize);
+        m_windowSize = m_filtered.size();
+        m_bandEnds.clear();
+    }
+
+    bool Close ()
+    {
+        // finish the zlib stream with a final empty block and the adler32 of all the filtered data
+        assert(m_rowsWritten == m_height);
+        CompressBands();
+
+        std::vector<uint8_t> chunk;
+        BeginChunk(chunk, "IDAT");
+        chunk.insert(chunk.end(), { 0x01, 0x00, 0x00, 0xFF, 0xFF });
+        chunk.resize(chunk.size() + 4);
+        WriteBigEndian(&chunk[chunk.size() - 4], m_adler);
+        FinishChunk(chunk);
+        WriteChunk(chunk);
+
+        BeginChunk(chunk, "IEND");
+        FinishChunk(chunk);
+        WriteChunk(chunk);
+
+        if (fclose(m_file) != 0)
+            m_failed = true;
+        m_file = nullptr;
+        return !m_failed;
+    }
+};
+
+void EncodeValues (const float* linear, stbi_uc* values, size_t count)
+{
+    // convert linear values to 8 bit with the current transfer function and encode mode
+    if (g_encodeMode == EEncodeMode::Exact)
+    {
+        for (size_t index = 0; index < count; ++index)
+            values[index] = EncodeValue(linear[index], g_transferFunction);
+    }
+    else if (g_instructionSet != EInstructionSet::Scalar)
+    {
+        EncodeValuesFastAVX2(linear, values, count, GetEncodeTable(g_transferFunction));
+    }
+    else
+    {
+        EncodeValuesFast(linear, values, count, GetEncodeTable(g_transferFunction));
+    }
+}
+
+struct SEncodedImage
+{
+    // an image converted to 8 bits, ready to be written out. It's kept around so that only the parts of an image that change need encoding again.
+    std::vector<stbi_uc> m_pixels;
+    int m_width = 0;
+    int m_height = 0;
+    int m_channels = 0;
+};
+
+void EncodeImage (SImageInfo& image, SEncodedImage& encoded)
+{
+    // Encodes the dirty part of an interleaved image into the encoded image, and clears the dirty rect.
+    // If the encoded image doesn't match the image's size, all of it gets encoded. Rows are encoded in parallel.
+    assert(image.m_layout == EImageLayout::Interleaved);
+    SRect rect = image.m_dirty;
+    if (encoded.m_width != image.m_width || encoded.m_height != image.m_height || encoded.m_channels != image.m_channels)
+    {
+        encoded.m_width = image.m_width;
+        encoded.m_height = image.m_height;
+        encoded.m_channels = image.m_channels;
+        encoded.m_pixels.resize(size_t(image.m_width) * size_t(image.m_height) * size_t(image.m_channels));
+        rect = { 0, 0, image.m_width, image.m_height };
+    }
+
+    if (rect.x1 < rect.x2 && rect.y1 < rect.y2)
+    {
+        const size_t rowSize = size_t(image.m_width) * size_t(image.m_channels);
+        const size_t offset = size_t(rect.x1) * size_t(image.m_channels);
+        const size_t count = size_t(rect.x2 - rect.x1) * size_t(image.m_channels);
+        g_threadPool.ParallelFor(size_t(rect.y2 - rect.y1), [&] (size_t row)
+        {
+            const size_t y = size_t(rect.y1) + row;
+            EncodeValues(&image.m_pixels[y * rowSize + offset], &encoded.m_pixels[y * rowSize + offset], count);
+        });
+    }
+
+    image.m_dirty = { 0, 0, 0, 0 };
+}
+
+bool WriteImage (const char *fileName, const SEncodedImage& image)
+{
+    SPngWriter writer;
+    if (!writer.Open(fileName, image.m_width, image.m_height, image.m_channels))
+        return false;
+
+    const size_t rowSize = size_t(image.m_width) * size_t(image.m_channels);
+    const int bandRows = writer.BandRows();
+    for (int y = 0; y < image.m_height; y += bandRows)
+        writer.WriteRows(&image.m_pixels[size_t(y) * rowSize], std::min(bandRows, image.m_height - y));
+    return writer.Close();
+}
+
+bool WriteImage (const char *fileName, int width, int height, int numChannels, const float* pixels)
+{
+    // convert from linear to sRGB, clamp, and convert to uint8, a band of rows at a time. The rows of each band are converted in parallel.
+    SPngWriter writer;
+    if (!writer.Open(fileName, width, height, numChannels))
+        return false;
+
+    const size_t rowSize = size_t(width) * size_t(numChannels);
+    const int bandRows = writer.BandRows();
+    std::vector<stbi_uc> band(size_t(std::min(bandRows, height)) * rowSize);
+    for (int y = 0; y < height; y += bandRows)
+    {
+        const int numRows = std::min(bandRows, height - y);
+        g_threadPool.ParallelFor(size_t(numRows), [&] (size_t row)
+        {
+            EncodeValues(pixels + (size_t(y) + row) * rowSize, &band[row * rowSize], rowSize);
+        });
+        writer.WriteRows(&band[0], numRows);
+    }
+    return writer.Close();
+}
+
+struct SMappedFile
+{
+    // a read only memory mapping of a whole file
+    const uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _MSC_VER
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#else
+    int m_file = -1;
+#endif
+
+    ~SMappedFile ()
+    {
+        Close();
+    }
+
+    bool Open (const char* fileName)
+    {
+        Close();
+#ifdef _MSC_VER
+        m_file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+            return false;
+        m_size = size_t(size.QuadPart);
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!m_mapping)
+            return false;
+        m_data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        m_file = open(fileName, O_RDONLY);
+        struct stat info;
+        if (m_file < 0 || fstat(m_file, &info) != 0 || info.st_size == 0)
+            return false;
+        m_size = size_t(info.st_size);
+        void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+        m_data = (data == MAP_FAILED) ? nullptr : (const uint8_t*)data;
+#endif
+        return m_data != nullptr;
+    }
+
+    void Close ()
+    {
+#ifdef _MSC_VER
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data)
+            munmap((void*)m_data, m_size);
+        if (m_file >= 0)
+            close(m_file);
+        m_file = -1;
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+};
+
+struct SScratchFile
+{
+    // A temporary file mapped for reading and writing, which starts out zeroed and is deleted when it's closed.
+    // It lets the OS page a large buffer out to disk, instead of it all needing to fit in memory.
+    uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+#ifdef _MSC_VER
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+#else
+    int m_file = -1;
+#endif
+
+    ~SScratchFile ()
+    {
+        Close();
+    }
+
+    bool Create (const char* directory, size_t size)
+    {
+        Close();
+        m_size = size;
+#ifdef _MSC_VER
+        char fileName[MAX_PATH];
+        if (!GetTempFileNameA(directory, "pbs", 0, fileName))
+            return false;
+        m_file = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+        {
+            DeleteFileA(fileName);
+            return false;
+        }
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, DWORD(uint64_t(size) >> 32), DWORD(uint64_t(size) & 0xffffffff), nullptr);
+        if (!m_mapping)
+            return false;
+        m_data = (uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+        // the file is unlinked right away, so it goes away when it's closed, even if the process doesn't exit cleanly
+        char fileName[1024];
+        snprintf(fileName, sizeof(fileName), "%s/pbscratchXXXXXX", directory);
+        m_file = mkstemp(fileName);
+        if (m_file < 0)
+            return false;
+        unlink(fileName);
+        if (ftruncate(m_file, off_t(size)) != 0)
+            return false;
+        void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0);
+        m_data = (data == MAP_FAILED) ? nullptr : (uint8_t*)data;
+#endif
+        return m_data != nullptr;
+    }
+
+    void Close ()
+    {
+#ifdef _MSC_VER
+        if (m_data)
+            UnmapViewOfFile(m_data);
+        if (m_mapping)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+#else
+        if (m_data)
+            munmap(m_data, m_size);
+        if (m_file >= 0)
+            close(m_file);
+        m_file = -1;
+#endif
+        m_data = nullptr;
+        m_size = 0;
+    }
+};
+
+bool GetFileSizeAndTime (const char* fileName, int64_t& size, int64_t& modifiedTime)
+{
+#ifdef _MSC_VER
+    struct _stat64 info;
+    if (_stat64(fileName, &info) != 0)
+        return false;
+#else
+    struct stat info;
+    if (stat(fileName, &info) != 0)
+        return false;
+#endif
+    size = int64_t(info.st_size);
+    modifiedTime = int64_t(info.st_mtime);
+    return true;
+}
+
+uint64_t HashBytes (uint64_t hash, const void* data, size_t size)
+{
+    // FNV-1a. Start with a hash of 14695981039346656037.
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t index = 0; index < size; ++index)
+    {
+        hash ^= bytes[index];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Images can be cached on disk as the linear floats they decode to, so loading them again is just a copy out of a memory mapped file.
+// Cache files are named by a hash of the image's path, size, modified time, and the settings that change how it decodes.
+// They also hold the image file's size and modified time, which have to match for the cache file to be used, so a hit never reads the image file.
+// Bump c_imageCacheVersion when the format of the cache files, or the way images decode, changes.
+const uint32_t c_imageCacheVersion = 2;
+const uint32_t c_imageCacheMagic = 0x43494250;    // "PBIC"
+
+struct SImageCacheHeader
+{
+    uint32_t m_magic;
+    uint32_t m_version;
+    int64_t m_sourceSize;
+    int64_t m_sourceModifiedTime;
+    int32_t m_width;
+    int32_t m_height;
+    int32_t m_channels;
+    int32_t m_transferFunction;
+};
+
+// the pixels start this far into the file, so they are aligned in the mapping
+const size_t c_imageCacheDataOffset = 64;
+
+bool LoadImageFile (SImageInfo& image, const char* fileName, int desiredChannels, const char* cacheDirectory)
+{
+    // Loads an interleaved image, going through the image cache if there is a cache directory.
+    if (!cacheDirectory)
+        return image.Load(fileName, desiredChannels);
+
+    int64_t sourceSize = 0, modifiedTime = 0;
+    if (!GetFileSizeAndTime(fileName, sourceSize, modifiedTime))
+    {
+        printf("Could not load file %s\n", fileName);
+        return false;
+    }
+
+    uint64_t key = HashBytes(14695981039346656037ull, &c_imageCacheVersion, sizeof(c_imageCacheVersion));
+    key = HashBytes(key, fileName, strlen(fileName));
+    key = HashBytes(key, &sourceSize, sizeof(sourceSize));
+    key = HashBytes(key, &modifiedTime, sizeof(modifiedTime));
+    key = HashBytes(key, &desiredChannels, sizeof(desiredChannels));
+    key = HashBytes(key, &g_transferFunction, sizeof(g_transferFunction));
+
+    char cacheFileName[1024];
+    snprintf(cacheFileName, sizeof(cacheFileName), "%s/%016llx.image", cacheDirectory, (unsigned long long)key);
+
+    // use the cache file if it's there and is for this exact image
+    SMappedFile cache;
+    if (cache.Open(cacheFileName) && cache.m_size >= c_imageCacheDataOffset)
+    {
+        SImageCacheHeader header;
+        memcpy(&header, cache.m_data, sizeof(header));
+        size_t numValues = size_t(header.m_width) * size_t(header.m_height) * size_t(header.m_channels);
+        if (header.m_magic == c_imageCacheMagic && header.m_version == c_imageCacheVersion &&
+            header.m_sourceSize == sourceSize && header.m_sourceModifiedTime == modifiedTime &&
+            header.m_channels == desiredChannels && header.m_transferFunction == int32_t(g_transferFunction) &&
+            cache.m_size == c_imageCacheDataOffset + numValues * sizeof(float))
+        {
+            image.m_width = header.m_width;
+            image.m_height = header.m_height;
+            image.m_channels = header.m_channels;
+            image.Allocate(EImageLayout::Interleaved);
+            memcpy(&image.m_pixels[0], cache.m_data + c_imageCacheDataOffset, numValues * sizeof(float));
+            return true;
+        }
+    }
+    cache.Close();
+
+    // otherwise decode the image, and write the cache file for next time
+    SMappedFile source;
+    if (!source.Open(fileName))
+    {
+        printf("Could not load file %s\n", fileName);
+        return false;
+    }
+    if (!image.LoadFromMemory(source.m_data, source.m_size, fileName, desiredChannels))
+        return false;
+
+    FILE* file = fopen(cacheFileName, "wb");
+    if (!file)
+    {
+        printf(__FUNCTION__ "() error: Could not write %s\n", cacheFileName);
+        return true;
+    }
+
+    uint8_t header[c_imageCacheDataOffset] = {};
+    SImageCacheHeader cacheHeader = { c_imageCacheMagic, c_imageCacheVersion, sourceSize, modifiedTime, image.m_width, image.m_height, image.m_channels, int32_t(g_transferFunction) };
+    memcpy(header, &cacheHeader, sizeof(cacheHeader));
+    fwrite(header, 1, sizeof(header), file);
+    fwrite(&image.m_pixels[0], sizeof(float), image.m_pixels.size(), file);
+    if (ferror(file) != 0)
+        printf(__FUNCTION__ "() error: Could not write %s\n", cacheFileName);
+    fclose(file);
+    return true;
+}
+
+struct SPixelSpan
+{
+    // a run of pixels on one row of a grid, as the index of the first pixel and how many there are
+    size_t m_start = 0;
+    size_t m_count = 0;
+};
+
+inline int32_t PopCount (uint64_t value)
+{
+    // counts the set bits, without needing the popcnt instruction
+    value -= (value >> 1) & 0x5555555555555555ull;
+    value = (value & 0x3333333333333333ull) + ((value >> 2) & 0x3333333333333333ull);
+    value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return int32_t((value * 0x0101010101010101ull) >> 56);
+}
+
+inline int32_t HighestSetBit (uint64_t value)
+{
+    // value must not be zero
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long bit;
+    _BitScanReverse64(&bit, value);
+    return int32_t(bit);
+#elif defined(_MSC_VER)
+    unsigned long bit;
+    if (_BitScanReverse(&bit, uint32_t(value >> 32)))
+        return int32_t(bit) + 32;
+    _BitScanReverse(&bit, uint32_t(value));
+    return int32_t(bit);
+#else
+    return 63 - int32_t(__builtin_clzll(value));
+#endif
+}
+
+struct SBitMask
+{
+    // A mask stored as one bit per pixel. Each row starts on a new 64 bit word, and the bits past the width of a row are always zero.
+    // Trim also fills in the runs of all mask pixels, and of interior and border pixels, in the order they are in the image.
+    int m_width = 0;
+    int m_height = 0;
+    size_t m_rowWords = 0;
+    std::vector<uint64_t> m_bits;
+    std::vector<SPixelSpan> m_spans;
+    std::vector<SPixelSpan> m_interiorSpans;
+    std::vector<SPixelSpan> m_borderSpans;
+
+    void Allocate (int width, int height)
+    {
+        // all pixels start off
+        m_width = width;
+        m_height = height;
+        m_rowWords = (size_t(width) + 63) / 64;
+        m_bits.assign(m_rowWords * size_t(height), 0);
+        m_spans.clear();
+        m_interiorSpans.clear();
+        m_borderSpans.clear();
+    }
+
+    void FromImage (const SImageInfo& image)
+    {
+        // pixels are on when their first channel is more than zero
+        assert(image.m_layout == EImageLayout::Interleaved);
+        Allocate(image.m_width, image.m_height);
+        for (int y = 0; y < m_height; ++y)
+        {
+            const float* pixel = image.GetPixel(0, y);
+            uint64_t* row = GetRow(y);
+            for (int x = 0; x < m_width; ++x)
+                row[x / 64] |= uint64_t(pixel[size_t(x) * image.m_channels] > 0.0f ? 1 : 0) << (x % 64);
+        }
+    }
+
+    const uint64_t* GetRow (int y) const
+    {
+        return &m_bits[size_t(y) * m_rowWords];
+    }
+
+    uint64_t* GetRow (int y)
+    {
+        return &m_bits[size_t(y) * m_rowWords];
+    }
+
+    bool Get (int x, int y) const
+    {
+        return ((GetRow(y)[x / 64] >> (x % 64)) & 1) != 0;
+    }
+};
+
+int FindNextBit (const uint64_t* row, int x, int width, bool value)
+{
+    // returns where the next bit that is value is, starting at x, or width if there isn't one
+    const uint64_t flip = value ? 0 : ~0ull;
+    size_t word = size_t(x) / 64;
+    uint64_t bits = (row[word] ^ flip) & (~0ull << (x % 64));
+    while (bits == 0)
+    {
+        ++word;
+        if (word * 64 >= size_t(width))
+            return width;
+        bits = row[word] ^ flip;
+    }
+    return std::min(int(word * 64) + CountTrailingZeros(bits), width);
+}
+
+void FindBitRuns (const uint64_t* row, int width, size_t rowStart, std::vector<SPixelSpan>& spans)
+{
+    // adds a span for each run of set bits in the row. rowStart is the pixel index of the start of the row.
+    for (int x = FindNextBit(row, 0, width, true); x < width; )
+    {
+        int end = FindNextBit(row, x, width, false);
+        SPixelSpan span;
+        span.m_start = rowStart + size_t(x);
+        span.m_count = size_t(end - x);
+        spans.push_back(span);
+        x = (end < width) ? FindNextBit(row, end, width, true) : width;
+    }
+}
+
+bool LoadMaskFile (SBitMask& mask, const char* fileName, const char* cacheDirectory)
+{
+    // masks are loaded like any other image, and then turned into bits
+    SImageInfo image;
+    if (!LoadImageFile(image, fileName, 1, cacheDirectory))
+        return false;
+    mask.FromImage(image);
+    return true;
+}
+
+bool GetPasteRects (int sourceWidth, int sourceHeight, int destWidth, int destHeight, int pasteX, int pasteY, SRect& sourceRect, SRect& destRect)
+{
+    // calculate details of paste, handling negative paste locations and images larger than the destination etc.
+    // returns false if nothing of the source lands on the destination.
+    sourceRect = { 0, 0, sourceWidth, sourceHeight };
+    destRect = { pasteX, pasteY, pasteX + sourceWidth, pasteY + sourceHeight };
+
+    if (destRect.x1 < 0)
+    {
+        sourceRect.x1 -= destRect.x1;
+        destRect.x1 = 0;
+    }
+
+    if (destRect.y1 < 0)
+    {
+        sourceRect.y1 -= destRect.y1;
+        destRect.y1 = 0;
+    }
+
+    if (destRect.x2 >= destWidth)
+    {
+        int difference = (destRect.x2 - destWidth) + 1;
+        sourceRect.x2 -= difference;
+        destRect.x2 = destWidth - 1;
+    }
+
+    if (destRect.y2 >= destHeight)
+    {
+        int difference = (destRect.y2 - destHeight) + 1;
+        sourceRect.y2 -= difference;
+        destRect.y2 = destHeight - 1;
+    }
+
+    return sourceRect.x2 > sourceRect.x1 && sourceRect.y2 > sourceRect.y1;
+}
+
+template <typename TFunction>
+void ForEachSpanInRect (const std::vector<SPixelSpan>& spans, int width, const SRect& rect, const TFunction& function)
+{
+    // calls function(x, y, count) for the part of each span inside of the rect. width is the width of the grid the spans are on.
+    // The spans need to be in row order, so the first row of the rect can be found with a binary search.
+    auto first = std::lower_bound(spans.begin(), spans.end(), size_t(rect.y1) * size_t(width),
+        [] (const SPixelSpan& span, size_t start)
+        {
+            return span.m_start < start;
+        }
+    );
+
+    for (auto it = first; it != spans.end(); ++it)
+    {
+        const int y = int(it->m_start / size_t(width));
+        if (y >= rect.y2)
+            break;
+
+        const int spanX = int(it->m_start % size_t(width));
+        const int x1 = std::max(spanX, rect.x1);
+        const int x2 = std::min(spanX + int(it->m_count), rect.x2);
+        if (x1 < x2)
+            function(x1, y, x2 - x1);
+    }
+}
+
+template <typename TFunction>
+void ForEachPasteRun (const std::vector<SPixelSpan>& spans, int width, const SRect& sourceRect, const SRect& destRect, const TFunction& function)
+{
+    // calls function(sourceX, sourceY, destX, destY, count) for each span, clipped to the source rect. width is the width of the grid the spans are on.
+    ForEachSpanInRect(spans, width, sourceRect,
+        [&] (int x, int y, int count)
+        {
+            function(x, y, destRect.x1 + x - sourceRect.x1, destRect.y1 + y - sourceRect.y1, count);
+        }
+    );
+}
+
+template <typename TGetSolved>
+void PasteSolvedPixels (const SBitMask& mask, const TGetSolved& getSolved, SImageInfo& dest, int pasteX, int pasteY)
+{
+    // paste the solved pixels onto the destination a run at a time, marking the pasted area of the destination as dirty.
+    // getSolved(channel, x, y) returns where the solved values of a channel are for an interior run starting at x, y. Border pixels aren't solved for, and are pasted as zero.
+    SRect sourceRect, destRect;
+    if (!GetPasteRects(mask.m_width, mask.m_height, dest.m_width, dest.m_height, pasteX, pasteY, sourceRect, destRect))
+        return;
+
+    ForEachPasteRun(mask.m_interiorSpans, mask.m_width, sourceRect, destRect,
+        [&] (int sourceX, int sourceY, int destX, int destY, int count)
+        {
+            const float* red = getSolved(0, sourceX, sourceY);
+            const float* green = getSolved(1, sourceX, sourceY);
+            const float* blue = getSolved(2, sourceX, sourceY);
+            float* destPixel = dest.GetPixel(destX, destY);
+            for (int index = 0; index < count; ++index)
+            {
+                destPixel[index * 3 + 0] = red[index];
+                destPixel[index * 3 + 1] = green[index];
+                destPixel[index * 3 + 2] = blue[index];
+            }
+        }
+    );
+
+    ForEachPasteRun(mask.m_borderSpans, mask.m_width, sourceRect, destRect,
+        [&] (int, int, int destX, int destY, int count)
+        {
+            memset(dest.GetPixel(destX, destY), 0, sizeof(float) * 3 * size_t(count));
+        }
+    );
+
+    dest.MarkDirty(destRect);
+}
+
+void NaivePaste (const SImageInfo &source, const SBitMask& mask, SEncodedImage &dest, int pasteX, int pasteY)
+{
+    // paste onto the encoded destination image.
+    // Each run of mask pixels is encoded straight into the destination, so only the pasted pixels need encoding.
+    SRect sourceRect, destRect;
+    if (!GetPasteRects(source.m_width, source.m_height, dest.m_width, dest.m_height, pasteX, pasteY, sourceRect, destRect))
+        return;
+
+    ForEachPasteRun(mask.m_spans, mask.m_width, sourceRect, destRect,
+        [&] (int sourceX, int sourceY, int destX, int destY, int count)
+        {
+            stbi_uc* destPixel = &dest.m_pixels[(size_t(destY) * size_t(dest.m_width) + size_t(destX)) * 3];
+            EncodeValues(source.GetPixel(sourceX, sourceY), destPixel, size_t(count) * 3);
+        }
+    );
+}
+
+void InvertMatrixDestructive (const size_t matrixDimension, std::vector<float>& matrix, std::vector<float>& matrixInverted)
+{
+    // make sure the matrix and dimensions parameter match up
+    assert(matrix.size() == matrixDimension * matrixDimension);
+
+    // initialize the inverted matrix to identity
+    matrixInverted.resize(matrix.size(), 0.0f);
+    size_t index = 0;
+    for (size_t i = 0; i < matrixDimension; ++i)
+    {
+        matrixInverted[index] = 1.0f;
+        index += matrixDimension + 1;
+    }
+
+    // invert matrix
+
+    // for each column in the matrix...
+    for (size_t columnIndex = 0; columnIndex < matrixDimension; ++columnIndex)
+    {
+        // find a row that has a non zero value in that row, that isn't a row we already processed
+        size_t rowIndex = columnIndex;
+        size_t rowBegin = rowIndex * matrixDimension;
+        while (rowIndex < matrixDimension && matrix[rowBegin + columnIndex] == 0.0f)
+        {
+            rowBegin += matrixDimension;
+            ++rowIndex;
+        }
+        assert(rowIndex < matrixDimension);
+
+        // swap that row with the row "columnIndex" in both the matrix and inverted matrix
+        std::swap_ranges(matrix.begin() + rowBegin, matrix.begin() + rowBegin + matrixDimension, matrix.begin() + matrixDimension * columnIndex);
+        std::swap_ranges(matrixInverted.begin() + rowBegin, matrixInverted.begin() + rowBegin + matrixDimension, matrixInverted.begin() + matrixDimension * columnIndex);
+        rowBegin = matrixDimension * columnIndex;
+
+        // scale that row to have a value of 1.0 at that location, in both matrices
+        float scale = matrix[rowBegin + columnIndex];
+        if (scale != 1.0f)
+        {
+            for (size_t index = 0; index < matrixDimension; ++index)
+            {
+                matrix[rowBegin + index] /= scale;
+                matrixInverted[rowBegin + index] /= scale;
+            }
+        }
+
+        // for all other rows that are not this row, subtract a multiple of this row to make them have a zero in that column
+        for (size_t rowIndex = 0; rowIndex < matrixDimension; ++rowIndex)
+        {
+            if (rowIndex == columnIndex)
+                continue;
+
+            size_t otherRowBegin = rowIndex * matrixDimension;
+            float scale = matrix[otherRowBegin + columnIndex];
 
             if (scale != 0.0f)
             {
-                for (size_t index = 0; index < matrixDimension; ++index)
+                for (size_t index = 0; index < matrixDimension; ++index)
+                {
+                    matrix[otherRowBegin + index] -= matrix[rowBegin + index] * scale;
+                    matrixInverted[otherRowBegin + index] -= matrixInverted[rowBegin + index] * scale;
+                }
+            }
+        }
+    }
+}
+
+void MatrixMultiply (const std::vector<float>& matrix, const std::vector<float>& inputVector, std::vector<float>& outputVector)
+{
+    size_t size = inputVector.size();
+    
+    assert(matrix.size() == size * size);
+    
+    outputVector.resize(inputVector.size());
+
+    for (size_t column = 0; column < size; ++column)
+    {
+        outputVector[column] = 0;
+
+        for (size_t index = 0; index < size; ++index)
+        {
+            outputVector[column] += inputVector[index] * matrix[column * size + index];
+        }
+    }
+}
+
+struct SSparseMatrix
+{
+    // Every row of the matrix has a 4 on the diagonal, and a -1 in the column of each neighbor that is also being solved for.
+    // So, all we store per row is the matrix column of the left, right, up and down neighbors, or -1 if that neighbor is a boundary condition.
+    std::vector<size_t> m_neighbors;
+    size_t m_dimension = 0;
+
+    inline const size_t* GetNeighbors (size_t row) const
+    {
+        return &m_neighbors[row * 4];
+    }
+};
+
+void MakeSparseMatrix (const SBitMask& mask, size_t numSolvePixels, const std::vector<int32_t>& pixelIndexToMatrixColumn, SSparseMatrix& matrix)
+{
+    matrix.m_dimension = numSolvePixels;
+    matrix.m_neighbors.resize(numSolvePixels * 4, size_t(-1));
+
+    // solve pixels are never on the edge of the mask, so the first and last rows and columns can be skipped
+    for (int y = 1; y < mask.m_height - 1; ++y)
+    {
+        const int32_t* columns = &pixelIndexToMatrixColumn[y * mask.m_width];
+        for (int x = 1; x < mask.m_width - 1; ++x)
+        {
+            // skip all pixels that don't show up in the matrix. That means they don't need to be solved for.
+            int32_t matrixColumn = columns[x];
+            if (matrixColumn < 0)
+                continue;
+
+            // store what matrix columns our neighbors belong in. Neighbors not in the matrix become size_t(-1).
+            size_t* neighbors = &matrix.m_neighbors[matrixColumn * 4];
+            neighbors[0] = size_t(ptrdiff_t(columns[x - 1]));
+            neighbors[1] = size_t(ptrdiff_t(columns[x + 1]));
+            neighbors[2] = size_t(ptrdiff_t(columns[x - mask.m_width]));
+            neighbors[3] = size_t(ptrdiff_t(columns[x + mask.m_width]));
+        }
+    }
+}
+
+void SparseMatrixToDense (const SSparseMatrix& matrix, std::vector<float>& denseMatrix)
+{
+    size_t size = matrix.m_dimension;
+    denseMatrix.resize(size * size);
+    std::fill(denseMatrix.begin(), denseMatrix.end(), 0.0f);
+
+    for (size_t row = 0; row < size; ++row)
+    {
+        float* denseRow = &denseMatrix[row * size];
+        denseRow[row] = 4.0f;
+
+        const size_t* neighbors = matrix.GetNeighbors(row);
+        for (int i = 0; i < 4; ++i)
+        {
+            if (neighbors[i] != size_t(-1))
+                denseRow[neighbors[i]] = -1.0f;
+        }
+    }
+}
+
+void SparseMatrixMultiply (const SSparseMatrix& matrix, const std::vector<float>& inputVector, std::vector<float>& outputVector)
+{
+    assert(inputVector.size() == matrix.m_dimension);
+
+    outputVector.resize(inputVector.size());
+
+    for (size_t row = 0; row < matrix.m_dimension; ++row)
+    {
+        const size_t* neighbors = matrix.GetNeighbors(row);
+
+        float value = 4.0f * inputVector[row];
+        for (int i = 0; i < 4; ++i)
+        {
+            if (neighbors[i] != size_t(-1))
+                value -= inputVector[neighbors[i]];
+        }
+        outputVector[row] = value;
+    }
+}
+
+double DotProduct (const std::vector<float>& a, const std::vector<float>& b)
+{
+    // accumulate in double so the sum doesn't lose precision on large masks
+    double ret = 0.0;
+    for (size_t index = 0; index < a.size(); ++index)
+        ret += double(a[index]) * double(b[index]);
+    return ret;
+}
+
+struct SSolveControl
+{
+    // How long the iterative solvers run, and who they tell how it's going.
+    // A solve stops once the residual of every channel is within m_tolerance of its right hand side, after m_maxIterations iterations when that isn't 0,
+    // or when m_callback returns false. m_callback is called each time the solver measures the residual, which is before the first iteration and after
+    // every iteration after that, except for red-black SOR, which only measures it every c_sorCheckInterval iterations.
+    float m_tolerance = c_solveTolerance;
+    int m_maxIterations = 0;
+    std::function<bool (const SSolveProgress&)> m_callback;
+};
+
+// The control PoissonBlend solves with. The solves inside of the other solvers, like the tiles of the tiled solver, always use the default control.
+SSolveControl g_solveControl;
+
+struct SSolveMonitor
+{
+    // Keeps track of a solve for the solver: tells the control's callback how it's going, and says when the solve should stop.
+    const SSolveControl& m_control;
+    SSolveProgress m_progress;
+    double m_inputLengthSquared[3];
+    int m_maxIterations;
+
+    SSolveMonitor (const char* solver, const SSolveControl& control, const double* inputLengthSquared, int numChannels, int maxIterations, int channel = -1) : m_control(control)
+    {
+        // maxIterations is the solver's own limit, which the control can lower
+        m_progress.m_solver = solver;
+        m_progress.m_channel = channel;
+        m_progress.m_numChannels = numChannels;
+        for (int index = 0; index < numChannels; ++index)
+            m_inputLengthSquared[index] = inputLengthSquared[index];
+        m_maxIterations = (control.m_maxIterations > 0) ? std::min(control.m_maxIterations, maxIterations) : maxIterations;
+    }
+
+    bool IsConverged (const double* residualLengthSquared, int index) const
+    {
+        return residualLengthSquared[index] <= m_inputLengthSquared[index] * double(m_control.m_tolerance) * double(m_control.m_tolerance);
+    }
+
+    bool Continue (int iteration, const double* residualLengthSquared, bool converged, bool stalled)
+    {
+        // Called each time the solver measures the residual, with whether it has converged by its own rules, and if that's because it stalled.
+        // Returns false when the solver should stop.
+        m_progress.m_iteration = iteration;
+        for (int index = 0; index < m_progress.m_numChannels; ++index)
+            m_progress.m_relativeResidual[index] = (m_inputLengthSquared[index] > 0.0) ? sqrt(residualLengthSquared[index] / m_inputLengthSquared[index]) : 0.0;
+
+        m_progress.m_finished = converged || iteration >= m_maxIterations;
+        if (m_progress.m_finished)
+            m_progress.m_stop = !converged ? ESolveStop::Budget : stalled ? ESolveStop::Stalled : ESolveStop::Tolerance;
+
+        if (m_control.m_callback && !m_control.m_callback(m_progress) && !m_progress.m_finished)
+        {
+            m_progress.m_finished = true;
+            m_progress.m_stop = ESolveStop::Callback;
+        }
+        return !m_progress.m_finished;
+    }
+};
+
+SSolveProgress SolveConjugateGradient (const SSparseMatrix& matrix, const std::vector<float>& inputVector, std::vector<float>& outputVector, const SSolveControl& control, int channel)
+{
+    // The matrix is symmetric and positive definite, so conjugate gradient will converge on the solution.
+    // It only ever needs to multiply the matrix by a vector, so memory use is linear in the number of pixels being solved.
+    size_t size = matrix.m_dimension;
+    outputVector.resize(size);
+    std::fill(outputVector.begin(), outputVector.end(), 0.0f);
+
+    // since our initial guess is zero, the residual starts out as the input vector
+    std::vector<float> residual = inputVector;
+    std::vector<float> direction = residual;
+    std::vector<float> matrixTimesDirection;
+
+    // it converges in at most one iteration per pixel, in theory
+    double residualLengthSquared = DotProduct(residual, residual);
+    SSolveMonitor monitor("cg", control, &residualLengthSquared, 1, int(std::min(size, size_t(INT_MAX))), channel);
+
+    for (int iteration = 0; monitor.Continue(iteration, &residualLengthSquared, monitor.IsConverged(&residualLengthSquared, 0), false); ++iteration)
+    {
+        SparseMatrixMultiply(matrix, direction, matrixTimesDirection);
+
+        float alpha = float(residualLengthSquared / DotProduct(direction, matrixTimesDirection));
+        for (size_t index = 0; index < size; ++index)
+        {
+            outputVector[index] += alpha * direction[index];
+            residual[index] -= alpha * matrixTimesDirection[index];
+        }
+
+        double newResidualLengthSquared = DotProduct(residual, residual);
+        float beta = float(newResidualLengthSquared / residualLengthSquared);
+        residualLengthSquared = newResidualLengthSquared;
+
+        for (size_t index = 0; index < size; ++index)
+            direction[index] = residual[index] + beta * direction[index];
+    }
+    return monitor.m_progress;
+}
+
+// The stencil kernels work on one color channel of a run of pixels on a row. Vectors on the stencil grid are planar, so a row of one
+// channel is contiguous and the kernels can work on 8 or 16 pixels at once. The same operations are done in the same order in every version,
+// so they all give the same results.
+void StencilMultiplyScalar (const float* input, float* output, size_t count, ptrdiff_t rowStride)
+{
+    for (size_t index = 0; index < count; ++index)
+    {
+        const float* in = input + index;
+        output[index] = 4.0f * in[0] - in[-1] - in[1] - in[-rowStride] - in[rowStride];
+    }
+}
+
+void StencilResidualScalar (const float* input, const float* solution, float* residual, size_t count, ptrdiff_t rowStride)
+{
+    for (size_t index = 0; index < count; ++index)
+    {
+        const float* value = solution + index;
+        residual[index] = input[index] - 4.0f * value[0] + value[-1] + value[1] + value[-rowStride] + value[rowStride];
+    }
+}
+
+void StencilRelaxScalar (const float* input, float* solution, size_t count, ptrdiff_t rowStride, size_t first, float omega)
+{
+    // over-relaxed Gauss-Seidel on every other pixel, starting at first. An omega of 1 is plain Gauss-Seidel.
+    const float keep = 1.0f - omega;
+    for (size_t index = first; index < count; index += 2)
+    {
+        float* value = solution + index;
+        float gaussSeidel = (input[index] + value[-1] + value[1] + value[-rowStride] + value[rowStride]) * 0.25f;
+        value[0] = gaussSeidel * omega + value[0] * keep;
+    }
+}
+
+void DivergenceScalar (const float* source, ptrdiff_t rowStride, const float* weights, size_t weightStride, float* output, size_t count)
+{
+    // The right hand side for a run of solve pixels, made straight from the source image. PoissonBlend explains the terms and the weights.
+    // weights holds six arrays, weightStride apart: the gradient weights of the run's row, which have count + 1 values, the gradient weights
+    // of the row below, and the weights of the left, right, up and down boundary conditions.
+    const float* gradientWeights = weights;
+    const float* gradientWeightsDown = weights + weightStride;
+    const float* weightLeft = weights + weightStride * 2;
+    const float* weightRight = weights + weightStride * 3;
+    const float* weightUp = weights + weightStride * 4;
+    const float* weightDown = weights + weightStride * 5;
+    for (size_t index = 0; index < count; ++index)
+    {
+        const float* value = source + index;
+        output[index] = 0.0f
+            + (value[1] - value[0]) * gradientWeights[index]
+            - (value[2] - value[1]) * gradientWeights[index + 1]
+            + (value[rowStride] - value[0]) * gradientWeights[index]
+            - (value[rowStride * 2] - value[rowStride]) * gradientWeightsDown[index]
+            + value[-1] * weightLeft[index]
+            + value[1] * weightRight[index]
+            + value[-rowStride] * weightUp[index]
+            + value[rowStride] * weightDown[index];
+    }
+}
+
+inline float MixGradient (float source, float destination)
+{
+    // the stronger of the two gradients, which is the source's when they are as strong
+    return (std::fabs(source) >= std::fabs(destination)) ? source : destination;
+}
+
+void MixedDivergenceScalar (const float* source, ptrdiff_t rowStride, const float* destination, ptrdiff_t destinationRowStride, const float* weights, size_t weightStride, float* output, size_t count)
+{
+    // The same as DivergenceScalar, but each gradient is the stronger of the source's and the destination's.
+    // destination is the destination pixel under the first pixel of the run, and is read from x to x + count + 1, on the rows from y to y + 2.
+    const float* gradientWeights = weights;
+    const float* gradientWeightsDown = weights + weightStride;
+    const float* weightLeft = weights + weightStride * 2;
+    const float* weightRight = weights + weightStride * 3;
+    const float* weightUp = weights + weightStride * 4;
+    const float* weightDown = weights + weightStride * 5;
+    for (size_t index = 0; index < count; ++index)
+    {
+        const float* value = source + index;
+        const float* dest = destination + index;
+        output[index] = 0.0f
+            + MixGradient(value[1] - value[0], dest[1] - dest[0]) * gradientWeights[index]
+            - MixGradient(value[2] - value[1], dest[2] - dest[1]) * gradientWeights[index + 1]
+            + MixGradient(value[rowStride] - value[0], dest[destinationRowStride] - dest[0]) * gradientWeights[index]
+            - MixGradient(value[rowStride * 2] - value[rowStride], dest[destinationRowStride * 2] - dest[destinationRowStride]) * gradientWeightsDown[index]
+            + value[-1] * weightLeft[index]
+            + value[1] * weightRight[index]
+            + value[-rowStride] * weightUp[index]
+            + value[rowStride] * weightDown[index];
+    }
+}
+
+// The AVX2 and AVX-512 kernels use masked loads and stores, so the last block of a run can be partial without touching memory outside of the run.
+// That keeps the ends of runs in the same instruction set, instead of handing them to the scalar kernels, which would mix AVX and SSE code and be slow.
+TARGET_AVX2 inline __m256i BlockMaskAVX2 (size_t count)
+{
+    // the lanes of a block that are in the run, when there are count pixels left in it
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(int(std::min(count, size_t(8)))), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+TARGET_AVX2 void StencilMultiplyAVX2 (const float* input, float* output, size_t count, ptrdiff_t rowStride)
+{
+    for (size_t index = 0; index < count; index += 8)
+    {
+        const float* in = input + index;
+        __m256i mask = BlockMaskAVX2(count - index);
+        __m256 result = _mm256_mul_ps(_mm256_set1_ps(4.0f), _mm256_maskload_ps(in, mask));
+        result = _mm256_sub_ps(result, _mm256_maskload_ps(in - 1, mask));
+        result = _mm256_sub_ps(result, _mm256_maskload_ps(in + 1, mask));
+        result = _mm256_sub_ps(result, _mm256_maskload_ps(in - rowStride, mask));
+        result = _mm256_sub_ps(result, _mm256_maskload_ps(in + rowStride, mask));
+        _mm256_maskstore_ps(output + index, mask, result);
+    }
+}
+
+TARGET_AVX2 void StencilResidualAVX2 (const float* input, const float* solution, float* residual, size_t count, ptrdiff_t rowStride)
+{
+    for (size_t index = 0; index < count; index += 8)
+    {
+        const float* value = solution + index;
+        __m256i mask = BlockMaskAVX2(count - index);
+        __m256 result = _mm256_sub_ps(_mm256_maskload_ps(input + index, mask), _mm256_mul_ps(_mm256_set1_ps(4.0f), _mm256_maskload_ps(value, mask)));
+        result = _mm256_add_ps(result, _mm256_maskload_ps(value - 1, mask));
+        result = _mm256_add_ps(result, _mm256_maskload_ps(value + 1, mask));
+        result = _mm256_add_ps(result, _mm256_maskload_ps(value - rowStride, mask));
+        result = _mm256_add_ps(result, _mm256_maskload_ps(value + rowStride, mask));
+        _mm256_maskstore_ps(residual + index, mask, result);
+    }
+}
+
+TARGET_AVX2 inline __m256 StencilRelaxBlockAVX2 (const float* input, const float* value, ptrdiff_t rowStride, __m256i mask, __m256 omegas, __m256 keep)
+{
+    __m256 gaussSeidel = _mm256_add_ps(_mm256_maskload_ps(input, mask), _mm256_maskload_ps(value - 1, mask));
+    gaussSeidel = _mm256_add_ps(gaussSeidel, _mm256_maskload_ps(value + 1, mask));
+    gaussSeidel = _mm256_add_ps(gaussSeidel, _mm256_maskload_ps(value - rowStride, mask));
+    gaussSeidel = _mm256_add_ps(gaussSeidel, _mm256_maskload_ps(value + rowStride, mask));
+    gaussSeidel = _mm256_mul_ps(gaussSeidel, _mm256_set1_ps(0.25f));
+    return _mm256_add_ps(_mm256_mul_ps(gaussSeidel, omegas), _mm256_mul_ps(_mm256_maskload_ps(value, mask), keep));
+}
+
+TARGET_AVX2 void StencilRelaxAVX2 (const float* input, float* solution, size_t count, ptrdiff_t rowStride, size_t first, float omega)
+{
+    // Only the lanes of the color being relaxed are loaded and stored. The other lanes would read pixels of that color on the rows above and below,
+    // which the threads relaxing the tiles there can be writing. The neighbors of the loaded lanes are all the other color, so no block reads what another one stores.
+    const __m256 omegas = _mm256_set1_ps(omega);
+    const __m256 keep = _mm256_set1_ps(1.0f - omega);
+    const __m256i colorMask = (first == 0) ? _mm256_setr_epi32(-1, 0, -1, 0, -1, 0, -1, 0) : _mm256_setr_epi32(0, -1, 0, -1, 0, -1, 0, -1);
+    for (size_t index = 0; index < count; index += 8)
+    {
+        __m256i mask = _mm256_and_si256(BlockMaskAVX2(count - index), colorMask);
+        __m256 result = StencilRelaxBlockAVX2(input + index, solution + index, rowStride, mask, omegas, keep);
+        _mm256_maskstore_ps(solution + index, mask, result);
+    }
+}
+
+TARGET_AVX2 void DivergenceAVX2 (const float* source, ptrdiff_t rowStride, const float* weights, size_t weightStride, float* output, size_t count)
+{
+    // the terms are added in the same order as the scalar kernel, so the results are the same
+    for (size_t index = 0; index < count; index += 8)
+    {
+        const float* value = source + index;
+        const float* weight = weights + index;
+        __m256i mask = BlockMaskAVX2(count - index);
+        __m256 center = _mm256_maskload_ps(value, mask);
+        __m256 right = _mm256_maskload_ps(value + 1, mask);
+        __m256 down = _mm256_maskload_ps(value + rowStride, mask);
+        __m256 gradientWeight = _mm256_maskload_ps(weight, mask);
+
+        __m256 result = _mm256_mul_ps(_mm256_sub_ps(right, center), gradientWeight);
+        result = _mm256_sub_ps(result, _mm256_mul_ps(_mm256_sub_ps(_mm256_maskload_ps(value + 2, mask), right), _mm256_maskload_ps(weight + 1, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_sub_ps(down, center), gradientWeight));
+        result = _mm256_sub_ps(result, _mm256_mul_ps(_mm256_sub_ps(_mm256_maskload_ps(value + rowStride * 2, mask), down), _mm256_maskload_ps(weight + weightStride, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_maskload_ps(value - 1, mask), _mm256_maskload_ps(weight + weightStride * 2, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(right, _mm256_maskload_ps(weight + weightStride * 3, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_maskload_ps(value - rowStride, mask), _mm256_maskload_ps(weight + weightStride * 4, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(down, _mm256_maskload_ps(weight + weightStride * 5, mask)));
+        _mm256_maskstore_ps(output + index, mask, result);
+    }
+}
+
+TARGET_AVX2 inline __m256 MixGradientAVX2 (__m256 source, __m256 destination)
+{
+    // MixGradient for 8 gradients, choosing with a blend instead of a branch
+    const __m256 signBit = _mm256_set1_ps(-0.0f);
+    __m256 sourceStronger = _mm256_cmp_ps(_mm256_andnot_ps(signBit, source), _mm256_andnot_ps(signBit, destination), _CMP_GE_OQ);
+    return _mm256_blendv_ps(destination, source, sourceStronger);
+}
+
+TARGET_AVX2 void MixedDivergenceAVX2 (const float* source, ptrdiff_t rowStride, const float* destination, ptrdiff_t destinationRowStride, const float* weights, size_t weightStride, float* output, size_t count)
+{
+    // the terms are added in the same order as the scalar kernel, so the results are the same
+    for (size_t index = 0; index < count; index += 8)
+    {
+        const float* value = source + index;
+        const float* dest = destination + index;
+        const float* weight = weights + index;
+        __m256i mask = BlockMaskAVX2(count - index);
+        __m256 center = _mm256_maskload_ps(value, mask);
+        __m256 right = _mm256_maskload_ps(value + 1, mask);
+        __m256 down = _mm256_maskload_ps(value + rowStride, mask);
+        __m256 destCenter = _mm256_maskload_ps(dest, mask);
+        __m256 destRight = _mm256_maskload_ps(dest + 1, mask);
+        __m256 destDown = _mm256_maskload_ps(dest + destinationRowStride, mask);
+        __m256 gradientWeight = _mm256_maskload_ps(weight, mask);
+
+        __m256 gradientRight = MixGradientAVX2(_mm256_sub_ps(_mm256_maskload_ps(value + 2, mask), right), _mm256_sub_ps(_mm256_maskload_ps(dest + 2, mask), destRight));
+        __m256 gradientDown = MixGradientAVX2(_mm256_sub_ps(_mm256_maskload_ps(value + rowStride * 2, mask), down), _mm256_sub_ps(_mm256_maskload_ps(dest + destinationRowStride * 2, mask), destDown));
+
+        __m256 result = _mm256_mul_ps(MixGradientAVX2(_mm256_sub_ps(right, center), _mm256_sub_ps(destRight, destCenter)), gradientWeight);
+        result = _mm256_sub_ps(result, _mm256_mul_ps(gradientRight, _mm256_maskload_ps(weight + 1, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(MixGradientAVX2(_mm256_sub_ps(down, center), _mm256_sub_ps(destDown, destCenter)), gradientWeight));
+        result = _mm256_sub_ps(result, _mm256_mul_ps(gradientDown, _mm256_maskload_ps(weight + weightStride, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_maskload_ps(value - 1, mask), _mm256_maskload_ps(weight + weightStride * 2, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(right, _mm256_maskload_ps(weight + weightStride * 3, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(_mm256_maskload_ps(value - rowStride, mask), _mm256_maskload_ps(weight + weightStride * 4, mask)));
+        result = _mm256_add_ps(result, _mm256_mul_ps(down, _mm256_maskload_ps(weight + weightStride * 5, mask)));
+        _mm256_maskstore_ps(output + index, mask, result);
+    }
+}
+
+TARGET_AVX512 inline __mmask16 BlockMaskAVX512 (size_t count)
+{
+    return (count >= 16) ? __mmask16(0xFFFF) : __mmask16((1u << count) - 1);
+}
+
+TARGET_AVX512 void StencilMultiplyAVX512 (const float* input, float* output, size_t count, ptrdiff_t rowStride)
+{
+    for (size_t index = 0; index < count; index += 16)
+    {
+        const float* in = input + index;
+        __mmask16 mask = BlockMaskAVX512(count - index);
+        __m512 result = _mm512_mul_ps(_mm512_set1_ps(4.0f), _mm512_maskz_loadu_ps(mask, in));
+        result = _mm512_sub_ps(result, _mm512_maskz_loadu_ps(mask, in - 1));
+        result = _mm512_sub_ps(result, _mm512_maskz_loadu_ps(mask, in + 1));
+        result = _mm512_sub_ps(result, _mm512_maskz_loadu_ps(mask, in - rowStride));
+        result = _mm512_sub_ps(result, _mm512_maskz_loadu_ps(mask, in + rowStride));
+        _mm512_mask_storeu_ps(output + index, mask, result);
+    }
+}
+
+TARGET_AVX512 void StencilResidualAVX512 (const float* input, const float* solution, float* residual, size_t count, ptrdiff_t rowStride)
+{
+    for (size_t index = 0; index < count; index += 16)
+    {
+        const float* value = solution + index;
+        __mmask16 mask = BlockMaskAVX512(count - index);
+        __m512 result = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, input + index), _mm512_mul_ps(_mm512_set1_ps(4.0f), _mm512_maskz_loadu_ps(mask, value)));
+        result = _mm512_add_ps(result, _mm512_maskz_loadu_ps(mask, value - 1));
+        result = _mm512_add_ps(result, _mm512_maskz_loadu_ps(mask, value + 1));
+        result = _mm512_add_ps(result, _mm512_maskz_loadu_ps(mask, value - rowStride));
+        result = _mm512_add_ps(result, _mm512_maskz_loadu_ps(mask, value + rowStride));
+        _mm512_mask_storeu_ps(residual + index, mask, result);
+    }
+}
+
+TARGET_AVX512 inline __m512 StencilRelaxBlockAVX512 (const float* input, const float* value, ptrdiff_t rowStride, __mmask16 mask, __m512 omegas, __m512 keep)
+{
+    __m512 gaussSeidel = _mm512_add_ps(_mm512_maskz_loadu_ps(mask, input), _mm512_maskz_loadu_ps(mask, value - 1));
+    gaussSeidel = _mm512_add_ps(gaussSeidel, _mm512_maskz_loadu_ps(mask, value + 1));
+    gaussSeidel = _mm512_add_ps(gaussSeidel, _mm512_maskz_loadu_ps(mask, value - rowStride));
+    gaussSeidel = _mm512_add_ps(gaussSeidel, _mm512_maskz_loadu_ps(mask, value + rowStride));
+    gaussSeidel = _mm512_mul_ps(gaussSeidel, _mm512_set1_ps(0.25f));
+    return _mm512_add_ps(_mm512_mul_ps(gaussSeidel, omegas), _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, value), keep));
+}
+
+TARGET_AVX512 void StencilRelaxAVX512 (const float* input, float* solution, size_t count, ptrdiff_t rowStride, size_t first, float omega)
+{
+    // the same as StencilRelaxAVX2, 16 pixels at a time
+    const __m512 omegas = _mm512_set1_ps(omega);
+    const __m512 keep = _mm512_set1_ps(1.0f - omega);
+    const __mmask16 colorMask = (first == 0) ? __mmask16(0x5555) : __mmask16(0xAAAA);
+    for (size_t index = 0; index < count; index += 16)
+    {
+        __mmask16 mask = BlockMaskAVX512(count - index) & colorMask;
+        __m512 result = StencilRelaxBlockAVX512(input + index, solution + index, rowStride, mask, omegas, keep);
+        _mm512_mask_storeu_ps(solution + index, mask, result);
+    }
+}
+
+struct SStencilKernels
+{
+    const char* m_name;
+    EInstructionSet m_instructionSet;
+    void (*m_multiply) (const float* input, float* output, size_t count, ptrdiff_t rowStride);
+    void (*m_residual) (const float* input, const float* solution, float* residual, size_t count, ptrdiff_t rowStride);
+    void (*m_relax) (const float* input, float* solution, size_t count, ptrdiff_t rowStride, size_t first, float omega);
+    void (*m_divergence) (const float* source, ptrdiff_t rowStride, const float* weights, size_t weightStride, float* output, size_t count);
+    void (*m_mixedDivergence) (const float* source, ptrdiff_t rowStride, const float* destination, ptrdiff_t destinationRowStride, const float* weights, size_t weightStride, float* output, size_t count);
+};
+
+// From slowest to fastest. Making the right hand side is done once per blend, so there's no AVX-512 version of it.
+const SStencilKernels c_stencilKernels[] =
+{
+    { "scalar", EInstructionSet::Scalar, StencilMultiplyScalar, StencilResidualScalar, StencilRelaxScalar, DivergenceScalar, MixedDivergenceScalar },
+    { "avx2", EInstructionSet::AVX2, StencilMultiplyAVX2, StencilResidualAVX2, StencilRelaxAVX2, DivergenceAVX2, MixedDivergenceAVX2 },
+    { "avx512", EInstructionSet::AVX512, StencilMultiplyAVX512, StencilResidualAVX512, StencilRelaxAVX512, DivergenceAVX2, MixedDivergenceAVX2 },
+};
+
+SStencilKernels g_stencilKernels = c_stencilKernels[0];
+
+bool SelectStencilKernels (const char* name)
+{
+    // use the named kernels, or the fastest ones this CPU supports if there is no name
+    for (size_t index = sizeof(c_stencilKernels) / sizeof(c_stencilKernels[0]); index-- > 0;)
+    {
+        const SStencilKernels& kernels = c_stencilKernels[index];
+        if (name && strcmp(name, kernels.m_name))
+            continue;
+
+        if (!CPUSupports(kernels.m_instructionSet))
+        {
+            if (name)
+            {
+                printf(__FUNCTION__ "() error: This CPU does not support the %s kernels\n", name);
+                return false;
+            }
+            continue;
+        }
+
+        g_stencilKernels = kernels;
+        g_instructionSet = kernels.m_instructionSet;
+        return true;
+    }
+
+    printf(__FUNCTION__ "() error: Unknown kernels %s\n", name);
+    return false;
+}
+
+void MakePixelSpans (const std::vector<size_t>& pixels, int width, std::vector<SPixelSpan>& spans)
+{
+    // the pixels need to be in row order
+    spans.clear();
+    for (size_t pixelIndex : pixels)
+    {
+        if (!spans.empty())
+        {
+            SPixelSpan& span = spans.back();
+            assert(pixelIndex >= span.m_start + span.m_count);
+            if (pixelIndex == span.m_start + span.m_count && pixelIndex % width != 0)
+            {
+                span.m_count++;
+                continue;
+            }
+        }
+
+        spans.emplace_back();
+        spans.back().m_start = pixelIndex;
+        spans.back().m_count = 1;
+    }
+}
+
+struct SMultigridLevel
+{
+    // A level of the multigrid pyramid. Level 0 is the stencil grid itself, and each level after that is half the size.
+    // A pixel at (x,y) on a coarse level is the pixel at (2x,2y) on the level above it, and is solved for if that pixel is.
+    // The solve pixels are stored as runs on each row. Red and black pixels are split up by checkerboard color as they are relaxed, so each color can be relaxed independently.
+    std::vector<SPixelSpan> m_spans;
+
+    // The solve pixels that are near pixels not being solved for. The coarse levels only approximate where the boundary is, so these get extra smoothing.
+    std::vector<size_t> m_redBoundaryPixels;
+    std::vector<size_t> m_blackBoundaryPixels;
+
+    int m_width = 0;
+    int m_height = 0;
+
+    size_t NumPixels () const
+    {
+        return size_t(m_width) * size_t(m_height);
+    }
+};
+
+struct SMultigridBuffers
+{
+    // planar RGB values on the grid of a multigrid level, used while doing V-cycles
+    std::vector<float> m_solution;
+    std::vector<float> m_input;
+    std::vector<float> m_residual;
+};
+
+struct SStencil
+{
+    // The solve pixels, laid out on the trimmed mask grid. Vectors used with the stencil hold planar RGB values for every grid pixel: all of the red values,
+    // then all of the green, then all of the blue. They are zero at every pixel that isn't being solved for, so the five point stencil can be applied
+    // straight from the grid without any matrix at all.
+    std::vector<size_t> m_solvePixels;
+    std::vector<SPixelSpan> m_spans;
+    int m_width = 0;
+    int m_height = 0;
+
+    // 1 / the diagonal of the incomplete cholesky factor, per grid pixel. Only made if that preconditioner is used.
+    std::vector<float> m_incompleteCholesky;
+
+    // The multigrid pyramid. Only made if multigrid is used.
+    std::vector<SMultigridLevel> m_multigrid;
+
+    size_t NumPixels () const
+    {
+        return size_t(m_width) * size_t(m_height);
+    }
+};
+
+void MakeMultigridLevel (const std::vector<size_t>& solvePixels, int width, int height, SMultigridLevel& level, std::vector<bool>& isSolvePixel)
+{
+    level.m_width = width;
+    level.m_height = height;
+    MakePixelSpans(solvePixels, width, level.m_spans);
+
+    isSolvePixel.assign(size_t(width) * size_t(height), false);
+    for (size_t pixelIndex : solvePixels)
+        isSolvePixel[pixelIndex] = true;
+
+    for (size_t pixelIndex : solvePixels)
+    {
+        int x = int(pixelIndex % width);
+        int y = int(pixelIndex / width);
+
+        // see if there are any pixels near this one that aren't being solved for
+        bool nearBoundary = false;
+        for (int offsetY = -c_multigridBoundaryDistance; offsetY <= c_multigridBoundaryDistance; ++offsetY)
+        {
+            for (int offsetX = -c_multigridBoundaryDistance; offsetX <= c_multigridBoundaryDistance; ++offsetX)
+            {
+                int neighborX = x + offsetX;
+                int neighborY = y + offsetY;
+                if (neighborX < 0 || neighborY < 0 || neighborX >= width || neighborY >= height || !isSolvePixel[neighborY * width + neighborX])
+                    nearBoundary = true;
+            }
+        }
+
+        if (!nearBoundary)
+            continue;
+
+        if ((x + y) % 2 == 0)
+            level.m_redBoundaryPixels.push_back(pixelIndex);
+        else
+            level.m_blackBoundaryPixels.push_back(pixelIndex);
+    }
+}
+
+void MakeMultigrid (SStencil& stencil)
+{
+    std::vector<bool> isSolvePixel;
+    stencil.m_multigrid.clear();
+    stencil.m_multigrid.emplace_back();
+    MakeMultigridLevel(stencil.m_solvePixels, stencil.m_width, stencil.m_height, stencil.m_multigrid.back(), isSolvePixel);
+
+    // Keep making coarser levels until there are few enough pixels to solve directly by smoothing.
+    // A coarse pixel is only solved for if the fine pixel under it and that pixel's 4 neighbors are. If the coarse region reached
+    // out to the edge of the fine region, the coarse boundary would be further away than the fine one and the correction would overshoot there.
+    // Solve pixels are never on the edge of the mask, so the coarse grids have a border of pixels not being solved for, just like the fine grid.
+    std::vector<size_t> solvePixels = stencil.m_solvePixels;
+    int width = stencil.m_width;
+    while (solvePixels.size() >= c_multigridCoarsestPixels)
+    {
+        int height = stencil.m_multigrid.back().m_height;
+        int coarseWidth = width / 2 + 2;
+        int coarseHeight = height / 2 + 2;
+
+        std::vector<size_t> coarseSolvePixels;
+        for (size_t pixelIndex : solvePixels)
+        {
+            size_t x = pixelIndex % width;
+            size_t y = pixelIndex / width;
+            if (x % 2 != 0 || y % 2 != 0)
+                continue;
+
+            bool interior =
+                isSolvePixel[pixelIndex - 1] &&
+                isSolvePixel[pixelIndex + 1] &&
+                isSolvePixel[pixelIndex - width] &&
+                isSolvePixel[pixelIndex + width];
+
+            if (interior)
+                coarseSolvePixels.push_back((y / 2) * coarseWidth + (x / 2));
+        }
+
+        if (coarseSolvePixels.empty())
+            break;
+
+        stencil.m_multigrid.emplace_back();
+        MakeMultigridLevel(coarseSolvePixels, coarseWidth, coarseHeight, stencil.m_multigrid.back(), isSolvePixel);
+
+        solvePixels.swap(coarseSolvePixels);
+        width = coarseWidth;
+    }
+}
+
+void MakeStencil (const SBitMask& mask, size_t numSolvePixels, const std::vector<int32_t>& pixelIndexToMatrixColumn, EPreconditioner preconditioner, SStencil& stencil)
+{
+    stencil.m_width = mask.m_width;
+    stencil.m_height = mask.m_height;
+
+    // find the grid pixel of each matrix column
+    stencil.m_solvePixels.resize(numSolvePixels);
+    size_t numPixels = size_t(mask.m_width) * size_t(mask.m_height);
+    for (size_t pixelIndex = 0; pixelIndex < numPixels; ++pixelIndex)
+    {
+        int32_t matrixColumn = pixelIndexToMatrixColumn[pixelIndex];
+        if (matrixColumn >= 0)
+            stencil.m_solvePixels[matrixColumn] = pixelIndex;
+    }
+    MakePixelSpans(stencil.m_solvePixels, stencil.m_width, stencil.m_spans);
+
+    // Incomplete cholesky with no fill in. The factor L has the same shape as the lower half of the matrix, and since no two lower neighbors
+    // of a pixel share a lower neighbor, the off diagonal values are just -1 / the neighbor's diagonal. That means all we need to store is the diagonal:
+    // diagonal^2 = 4 - (1/diagonalLeft)^2 - (1/diagonalUp)^2
+    if (preconditioner == EPreconditioner::IncompleteCholesky)
+    {
+        stencil.m_incompleteCholesky.resize(numPixels, 0.0f);
+        for (size_t pixelIndex : stencil.m_solvePixels)
+        {
+            float left = stencil.m_incompleteCholesky[pixelIndex - 1];
+            float up = stencil.m_incompleteCholesky[pixelIndex - mask.m_width];
+            stencil.m_incompleteCholesky[pixelIndex] = 1.0f / std::sqrt(4.0f - left * left - up * up);
+        }
+    }
+
+    if (preconditioner == EPreconditioner::Multigrid)
+        MakeMultigrid(stencil);
+}
+
+void StencilMultiply (const SStencil& stencil, const std::vector<float>& input, std::vector<float>& output)
+{
+    // multiply all three color channels by the matrix, a row of solve pixels at a time
+    output.resize(input.size(), 0.0f);
+
+    const size_t numPixels = stencil.NumPixels();
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        const float* in = &input[channel * numPixels];
+        float* out = &output[channel * numPixels];
+        for (const SPixelSpan& span : stencil.m_spans)
+            g_stencilKernels.m_multiply(in + span.m_start, out + span.m_start, span.m_count, stencil.m_width);
+    }
+}
+
+void StencilDotProduct (const SStencil& stencil, const std::vector<float>& a, const std::vector<float>& b, double dot[3])
+{
+    const size_t numPixels = stencil.NumPixels();
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        const float* planeA = &a[channel * numPixels];
+        const float* planeB = &b[channel * numPixels];
+        double sum = 0.0;
+        for (const SPixelSpan& span : stencil.m_spans)
+        {
+            for (size_t pixelIndex = span.m_start; pixelIndex < span.m_start + span.m_count; ++pixelIndex)
+                sum += double(planeA[pixelIndex]) * double(planeB[pixelIndex]);
+        }
+        dot[channel] = sum;
+    }
+}
+
+void StencilRelaxSpans (const SPixelSpan* spans, size_t numSpans, int width, size_t numPixels, int color, float omega, const std::vector<float>& input, std::vector<float>& solution)
+{
+    // Relaxes the pixels of one checkerboard color, red being 0 and black 1. The neighbors of a pixel are all the other color, so the order within a color doesn't matter.
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        const float* in = &input[channel * numPixels];
+        float* value = &solution[channel * numPixels];
+        for (size_t spanIndex = 0; spanIndex < numSpans; ++spanIndex)
+        {
+            const SPixelSpan& span = spans[spanIndex];
+            size_t first = (span.m_start % width + span.m_start / width + color) % 2;
+            g_stencilKernels.m_relax(in + span.m_start, value + span.m_start, span.m_count, width, first, omega);
+        }
+    }
+}
+
+void StencilResidualSpans (const SPixelSpan* spans, size_t numSpans, int width, size_t numPixels, const std::vector<float>& input, const std::vector<float>& solution, std::vector<float>& residual)
+{
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        const float* in = &input[channel * numPixels];
+        const float* value = &solution[channel * numPixels];
+        float* out = &residual[channel * numPixels];
+        for (size_t spanIndex = 0; spanIndex < numSpans; ++spanIndex)
+        {
+            const SPixelSpan& span = spans[spanIndex];
+            g_stencilKernels.m_residual(in + span.m_start, value + span.m_start, out + span.m_start, span.m_count, width);
+        }
+    }
+}
+
+void MultigridAllocateBuffers (const SStencil& stencil, std::vector<SMultigridBuffers>& buffers)
+{
+    buffers.resize(stencil.m_multigrid.size());
+    for (size_t levelIndex = 0; levelIndex < buffers.size(); ++levelIndex)
+    {
+        size_t size = stencil.m_multigrid[levelIndex].NumPixels() * 3;
+        buffers[levelIndex].m_solution.resize(size, 0.0f);
+        buffers[levelIndex].m_input.resize(size, 0.0f);
+        buffers[levelIndex].m_residual.resize(size, 0.0f);
+    }
+}
+
+void MultigridRelax (const SMultigridLevel& level, int color, const std::vector<float>& input, std::vector<float>& solution)
+{
+    // Gauss-Seidel on one color of the checkerboard
+    StencilRelaxSpans(level.m_spans.data(), level.m_spans.size(), level.m_width, level.NumPixels(), color, 1.0f, input, solution);
+}
+
+void MultigridRelaxPixels (const SMultigridLevel& level, const std::vector<size_t>& pixels, const std::vector<float>& input, std::vector<float>& solution)
+{
+    // Gauss-Seidel on a list of pixels which are all the same color
+    const ptrdiff_t rowStride = level.m_width;
+    const size_t numPixels = level.NumPixels();
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        const float* in = &input[channel * numPixels];
+        float* plane = &solution[channel * numPixels];
+        for (size_t pixelIndex : pixels)
+        {
+            float* value = &plane[pixelIndex];
+            value[0] = (in[pixelIndex] + value[-1] + value[1] + value[-rowStride] + value[rowStride]) * 0.25f;
+        }
+    }
+}
+
+void MultigridResidual (const SMultigridLevel& level, const std::vector<float>& input, const std::vector<float>& solution, std::vector<float>& residual)
+{
+    StencilResidualSpans(level.m_spans.data(), level.m_spans.size(), level.m_width, level.NumPixels(), input, solution, residual);
+}
+
+void MultigridRestrict (const SMultigridLevel& fineLevel, const std::vector<float>& fine, const SMultigridLevel& coarseLevel, std::vector<float>& coarse)
+{
+    // Full weighting. Grid spacing doubles on the coarse level, which makes the matrix 4 times smaller there.
+    // Instead of scaling the coarse matrix, the restricted values are scaled up by 4.
+    const ptrdiff_t rowStride = fineLevel.m_width;
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        const float* finePlane = &fine[channel * fineLevel.NumPixels()];
+        float* coarsePlane = &coarse[channel * coarseLevel.NumPixels()];
+        for (const SPixelSpan& span : coarseLevel.m_spans)
+        {
+            for (size_t pixelIndex = span.m_start; pixelIndex < span.m_start + span.m_count; ++pixelIndex)
+            {
+                size_t x = pixelIndex % coarseLevel.m_width;
+                size_t y = pixelIndex / coarseLevel.m_width;
+                const float* in = &finePlane[(y * 2) * fineLevel.m_width + (x * 2)];
+                coarsePlane[pixelIndex] = in[0]
+                    + (in[-1] + in[1] + in[-rowStride] + in[rowStride]) * 0.5f
+                    + (in[-rowStride - 1] + in[-rowStride + 1] + in[rowStride - 1] + in[rowStride + 1]) * 0.25f;
+            }
+        }
+    }
+}
+
+void MultigridProlongateAdd (const SMultigridLevel& fineLevel, std::vector<float>& fine, const SMultigridLevel& coarseLevel, const std::vector<float>& coarse)
+{
+    // bilinear interpolation of the coarse correction, added to the fine solution
+    const ptrdiff_t rowStride = coarseLevel.m_width;
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        float* finePlane = &fine[channel * fineLevel.NumPixels()];
+        const float* coarsePlane = &coarse[channel * coarseLevel.NumPixels()];
+        for (const SPixelSpan& span : fineLevel.m_spans)
+        {
+            for (size_t pixelIndex = span.m_start; pixelIndex < span.m_start + span.m_count; ++pixelIndex)
+            {
+                size_t x = pixelIndex % fineLevel.m_width;
+                size_t y = pixelIndex / fineLevel.m_width;
+                const float* in = &coarsePlane[(y / 2) * coarseLevel.m_width + (x / 2)];
+                bool oddX = (x % 2) == 1;
+                bool oddY = (y % 2) == 1;
+                if (oddX && oddY)
+                    finePlane[pixelIndex] += (in[0] + in[1] + in[rowStride] + in[rowStride + 1]) * 0.25f;
+                else if (oddX)
+                    finePlane[pixelIndex] += (in[0] + in[1]) * 0.5f;
+                else if (oddY)
+                    finePlane[pixelIndex] += (in[0] + in[rowStride]) * 0.5f;
+                else
+                    finePlane[pixelIndex] += in[0];
+            }
+        }
+    }
+}
+
+void MultigridVCycle (const SStencil& stencil, std::vector<SMultigridBuffers>& buffers, size_t levelIndex)
+{
+    // improves buffers[levelIndex].m_solution, using buffers[levelIndex].m_input as the right hand side
+    const SMultigridLevel& level = stencil.m_multigrid[levelIndex];
+    SMultigridBuffers& buffer = buffers[levelIndex];
+
+    // on the coarsest level, just smooth a lot. The second half of the sweeps go black then red, which keeps the cycle symmetric here too.
+    if (levelIndex + 1 == stencil.m_multigrid.size())
+    {
+        for (int sweep = 0; sweep < c_multigridCoarsestSweeps; ++sweep)
+        {
+            int firstColor = (sweep < c_multigridCoarsestSweeps / 2) ? 0 : 1;
+            MultigridRelax(level, firstColor, buffer.m_input, buffer.m_solution);
+            MultigridRelax(level, 1 - firstColor, buffer.m_input, buffer.m_solution);
+        }
+        return;
+    }
+
+    // smooth red then black on the way down, and black then red on the way up, so the cycle is symmetric and can be used as a preconditioner
+    for (int sweep = 0; sweep < c_multigridSmoothingSweeps; ++sweep)
+    {
+        MultigridRelax(level, 0, buffer.m_input, buffer.m_solution);
+        MultigridRelax(level, 1, buffer.m_input, buffer.m_solution);
+    }
+    for (int sweep = 0; sweep < c_multigridBoundarySweeps; ++sweep)
+    {
+        MultigridRelaxPixels(level, level.m_redBoundaryPixels, buffer.m_input, buffer.m_solution);
+        MultigridRelaxPixels(level, level.m_blackBoundaryPixels, buffer.m_input, buffer.m_solution);
+    }
+
+    // solve for the error on the coarser level, starting from zero. Pixels that aren't solved for are always zero, so the whole buffer can be cleared.
+    const SMultigridLevel& coarseLevel = stencil.m_multigrid[levelIndex + 1];
+    SMultigridBuffers& coarseBuffer = buffers[levelIndex + 1];
+    MultigridResidual(level, buffer.m_input, buffer.m_solution, buffer.m_residual);
+    MultigridRestrict(level, buffer.m_residual, coarseLevel, coarseBuffer.m_input);
+    std::fill(coarseBuffer.m_solution.begin(), coarseBuffer.m_solution.end(), 0.0f);
+    MultigridVCycle(stencil, buffers, levelIndex + 1);
+    MultigridProlongateAdd(level, buffer.m_solution, coarseLevel, coarseBuffer.m_solution);
+
+    for (int sweep = 0; sweep < c_multigridBoundarySweeps; ++sweep)
+    {
+        MultigridRelaxPixels(level, level.m_blackBoundaryPixels, buffer.m_input, buffer.m_solution);
+        MultigridRelaxPixels(level, level.m_redBoundaryPixels, buffer.m_input, buffer.m_solution);
+    }
+    for (int sweep = 0; sweep < c_multigridSmoothingSweeps; ++sweep)
+    {
+        MultigridRelax(level, 1, buffer.m_input, buffer.m_solution);
+        MultigridRelax(level, 0, buffer.m_input, buffer.m_solution);
+    }
+}
+
+void Precondition (const SStencil& stencil, EPreconditioner preconditioner, std::vector<SMultigridBuffers>& multigridBuffers, const std::vector<float>& residual, std::vector<float>& output)
+{
+    // The residual is zero at every pixel that isn't being solved for, and so is everything made from it here.
+    output.resize(residual.size(), 0.0f);
+    const size_t numPixels = stencil.NumPixels();
+
+    switch (preconditioner)
+    {
+        case EPreconditioner::None:
+        {
+            output = residual;
+            break;
+        }
+        case EPreconditioner::Jacobi:
+        {
+            for (size_t index = 0; index < residual.size(); ++index)
+                output[index] = residual[index] * 0.25f;
+            break;
+        }
+        case EPreconditioner::IncompleteCholesky:
+        {
+            // solve L * y = residual with forward substitution, then L^T * output = y with backward substitution, in place.
+            const std::vector<float>& invDiagonal = stencil.m_incompleteCholesky;
+            const size_t width = stencil.m_width;
+            for (int channel = 0; channel < 3; ++channel)
+            {
+                const float* in = &residual[channel * numPixels];
+                float* out = &output[channel * numPixels];
+                for (size_t pixelIndex : stencil.m_solvePixels)
+                {
+                    out[pixelIndex] = (in[pixelIndex]
+                        + out[pixelIndex - 1] * invDiagonal[pixelIndex - 1]
+                        + out[pixelIndex - width] * invDiagonal[pixelIndex - width]) * invDiagonal[pixelIndex];
+                }
+                for (auto it = stencil.m_solvePixels.rbegin(); it != stencil.m_solvePixels.rend(); ++it)
+                {
+                    size_t pixelIndex = *it;
+                    out[pixelIndex] = (out[pixelIndex] + (out[pixelIndex + 1] + out[pixelIndex + width]) * invDiagonal[pixelIndex]) * invDiagonal[pixelIndex];
+                }
+            }
+            break;
+        }
+        case EPreconditioner::Multigrid:
+        {
+            // a single V-cycle starting from zero
+            SMultigridBuffers& buffer = multigridBuffers[0];
+            buffer.m_input = residual;
+            std::fill(buffer.m_solution.begin(), buffer.m_solution.end(), 0.0f);
+            MultigridVCycle(stencil, multigridBuffers, 0);
+            output = buffer.m_solution;
+            break;
+        }
+    }
+}
+
+SSolveProgress SolvePreconditionedConjugateGradient (const SStencil& stencil, EPreconditioner preconditioner, const std::vector<float>& input, std::vector<float>& output, const SSolveControl& control, bool startFromOutput = false)
+{
+    // Solves all three color channels at once. They each have their own step sizes, but share every pass over the stencil.
+    // input and output are planar RGB values on the stencil grid. The initial guess is zero, unless startFromOutput is true, in which case it's output.
+    const size_t numPixels = stencil.NumPixels();
+    std::vector<float> residual;
+    if (startFromOutput)
+    {
+        residual.resize(input.size(), 0.0f);
+        StencilResidualSpans(stencil.m_spans.data(), stencil.m_spans.size(), stencil.m_width, numPixels, input, output, residual);
+    }
+    else
+    {
+        // since the initial guess is zero, the residual starts out as the input vector
+        output.resize(input.size());
+        std::fill(output.begin(), output.end(), 0.0f);
+        residual = input;
+    }
+
+    std::vector<float> preconditioned, direction, matrixTimesDirection;
+    std::vector<SMultigridBuffers> multigridBuffers;
+    if (preconditioner == EPreconditioner::Multigrid)
+        MultigridAllocateBuffers(stencil, multigridBuffers);
+    Precondition(stencil, preconditioner, multigridBuffers, residual, preconditioned);
+    direction = preconditioned;
+
+    double residualDotPreconditioned[3], residualLengthSquared[3], inputLengthSquared[3];
+    StencilDotProduct(stencil, residual, preconditioned, residualDotPreconditioned);
+    StencilDotProduct(stencil, residual, residual, residualLengthSquared);
+    StencilDotProduct(stencil, input, input, inputLengthSquared);
+
+    // it converges in at most one iteration per pixel, in theory
+    SSolveMonitor monitor("pcg", control, inputLengthSquared, 3, int(std::min(stencil.m_solvePixels.size(), size_t(INT_MAX))));
+    bool active[3];
+    for (int channel = 0; channel < 3; ++channel)
+        active[channel] = !monitor.IsConverged(residualLengthSquared, channel);
+
+    for (int iteration = 0; monitor.Continue(iteration, residualLengthSquared, !(active[0] || active[1] || active[2]), false); ++iteration)
+    {
+        StencilMultiply(stencil, direction, matrixTimesDirection);
+
+        // channels which have already converged get a step size of zero
+        double directionDotMatrixTimesDirection[3];
+        StencilDotProduct(stencil, direction, matrixTimesDirection, directionDotMatrixTimesDirection);
+        float alpha[3];
+        for (int channel = 0; channel < 3; ++channel)
+            alpha[channel] = active[channel] ? float(residualDotPreconditioned[channel] / directionDotMatrixTimesDirection[channel]) : 0.0f;
+
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            float* out = &output[channel * numPixels];
+            float* res = &residual[channel * numPixels];
+            const float* dir = &direction[channel * numPixels];
+            const float* matrixTimesDir = &matrixTimesDirection[channel * numPixels];
+            for (const SPixelSpan& span : stencil.m_spans)
+            {
+                for (size_t pixelIndex = span.m_start; pixelIndex < span.m_start + span.m_count; ++pixelIndex)
+                {
+                    out[pixelIndex] += alpha[channel] * dir[pixelIndex];
+                    res[pixelIndex] -= alpha[channel] * matrixTimesDir[pixelIndex];
+                }
+            }
+        }
+
+        StencilDotProduct(stencil, residual, residual, residualLengthSquared);
+        for (int channel = 0; channel < 3; ++channel)
+            active[channel] = active[channel] && !monitor.IsConverged(residualLengthSquared, channel);
+
+        Precondition(stencil, preconditioner, multigridBuffers, residual, preconditioned);
+
+        double newResidualDotPreconditioned[3];
+        StencilDotProduct(stencil, residual, preconditioned, newResidualDotPreconditioned);
+        float beta[3];
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            beta[channel] = active[channel] ? float(newResidualDotPreconditioned[channel] / residualDotPreconditioned[channel]) : 0.0f;
+            residualDotPreconditioned[channel] = newResidualDotPreconditioned[channel];
+        }
+
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            float* dir = &direction[channel * numPixels];
+            const float* pre = &preconditioned[channel * numPixels];
+            for (const SPixelSpan& span : stencil.m_spans)
+            {
+                for (size_t pixelIndex = span.m_start; pixelIndex < span.m_start + span.m_count; ++pixelIndex)
+                    dir[pixelIndex] = pre[pixelIndex] + beta[channel] * dir[pixelIndex];
+            }
+        }
+    }
+    return monitor.m_progress;
+}
+
+SSolveProgress SolveMultigrid (const SStencil& stencil, const std::vector<float>& input, std::vector<float>& output, const SSolveControl& control)
+{
+    // input and output are planar RGB values on the stencil grid.
+    std::vector<SMultigridBuffers> buffers;
+    MultigridAllocateBuffers(stencil, buffers);
+    buffers[0].m_input = input;
+
+    // Full multigrid to get the initial guess: restrict the right hand side all the way down, solve the coarsest level,
+    // then work back up, using the interpolated solution of each level as the starting point for a V-cycle on the next finer level.
+    for (size_t levelIndex = 1; levelIndex < stencil.m_multigrid.size(); ++levelIndex)
+        MultigridRestrict(stencil.m_multigrid[levelIndex - 1], buffers[levelIndex - 1].m_input, stencil.m_multigrid[levelIndex], buffers[levelIndex].m_input);
+
+    for (size_t levelIndex = stencil.m_multigrid.size(); levelIndex-- > 0;)
+    {
+        if (levelIndex + 1 < stencil.m_multigrid.size())
+            MultigridProlongateAdd(stencil.m_multigrid[levelIndex], buffers[levelIndex].m_solution, stencil.m_multigrid[levelIndex + 1], buffers[levelIndex + 1].m_solution);
+        MultigridVCycle(stencil, buffers, levelIndex);
+    }
+
+    // Then do V-cycles until the residual is small enough.
+    // On large masks, float precision can keep the V-cycles from getting the residual down to the tolerance. When a cycle stops making progress
+    // before then, the rest of the solve is handed to conjugate gradient, with a V-cycle as the preconditioner, starting from where the cycles got to.
+    double inputLengthSquared[3], residualLengthSquared[3], lastResidualLengthSquared[3];
+    StencilDotProduct(stencil, input, input, inputLengthSquared);
+    SSolveMonitor monitor("multigrid", control, inputLengthSquared, 3, c_multigridMaxCycles);
+    int cycle = 0;
+    bool stalled = false;
+    for (; ; ++cycle)
+    {
+        MultigridResidual(stencil.m_multigrid[0], buffers[0].m_input, buffers[0].m_solution, buffers[0].m_residual);
+        StencilDotProduct(stencil, buffers[0].m_residual, buffers[0].m_residual, residualLengthSquared);
+
+        bool converged = true;
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            bool withinTolerance = monitor.IsConverged(residualLengthSquared, channel);
+            converged = converged && withinTolerance;
+            stalled = stalled || (cycle > 0 && !withinTolerance && residualLengthSquared[channel] > lastResidualLengthSquared[channel] * 0.81);
+            lastResidualLengthSquared[channel] = residualLengthSquared[channel];
+        }
+        if (stalled && cycle < monitor.m_maxIterations)
+            break;
+        if (!monitor.Continue(cycle, residualLengthSquared, converged, false))
+            break;
+
+        MultigridVCycle(stencil, buffers, 0);
+    }
+
+    output.swap(buffers[0].m_solution);
+    if (!stalled || cycle >= monitor.m_maxIterations)
+        return monitor.m_progress;
+
+    // the conjugate gradient iterations carry on the cycle count, and get the rest of the budget
+    SSolveControl krylovControl = control;
+    krylovControl.m_maxIterations = monitor.m_maxIterations - cycle;
+    if (control.m_callback)
+    {
+        krylovControl.m_callback = [&control, cycle] (const SSolveProgress& krylovProgress)
+        {
+            SSolveProgress progress = krylovProgress;
+            progress.m_solver = "multigrid";
+            progress.m_iteration += cycle;
+            return control.m_callback(progress);
+        };
+    }
+    SSolveProgress progress = SolvePreconditionedConjugateGradient(stencil, EPreconditioner::Multigrid, input, output, krylovControl, true);
+    progress.m_solver = "multigrid";
+    progress.m_iteration += cycle;
+    return progress;
+}
+
+SSolveProgress SolveRedBlackSOR (const SStencil& stencil, const std::vector<float>& input, std::vector<float>& output, const SSolveControl& control)
+{
+    // input and output are planar RGB values on the stencil grid.
+    // Pixels of one checkerboard color only depend on pixels of the other color, so every tile of a color can be relaxed at the same time.
+    output.resize(input.size());
+    std::fill(output.begin(), output.end(), 0.0f);
+    const size_t numPixels = stencil.NumPixels();
+
+    // split the spans into tiles of rows. The spans are in row order, so each tile is a contiguous range of them.
+    const size_t numTiles = (size_t(stencil.m_height) + c_sorTileRows - 1) / c_sorTileRows;
+    std::vector<size_t> tileStarts(numTiles + 1, 0);
+    for (const SPixelSpan& span : stencil.m_spans)
+        tileStarts[span.m_start / stencil.m_width / c_sorTileRows + 1]++;
+    for (size_t tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+        tileStarts[tileIndex + 1] += tileStarts[tileIndex];
+
+    // The best over-relaxation factor for a rectangle is known, so use the one for the bounding rectangle of the mask.
+    const double pi = 3.14159265358979323846;
+    double jacobiSpectralRadius = (cos(pi / double(stencil.m_width)) + cos(pi / double(stencil.m_height))) * 0.5;
+    const float omega = float(2.0 / (1.0 + sqrt(1.0 - jacobiSpectralRadius * jacobiSpectralRadius)));
+
+    std::vector<float> residual(input.size(), 0.0f);
+    std::vector<double> tileResidualLengthSquared(numTiles * 3);
+
+    auto relaxTile = [&] (int color, size_t tileIndex)
+    {
+        const SPixelSpan* spans = stencil.m_spans.data() + tileStarts[tileIndex];
+        StencilRelaxSpans(spans, tileStarts[tileIndex + 1] - tileStarts[tileIndex], stencil.m_width, numPixels, color, omega, input, output);
+    };
+
+    auto residualTile = [&] (size_t tileIndex)
+    {
+        const SPixelSpan* spans = stencil.m_spans.data() + tileStarts[tileIndex];
+        size_t numSpans = tileStarts[tileIndex + 1] - tileStarts[tileIndex];
+        StencilResidualSpans(spans, numSpans, stencil.m_width, numPixels, input, output, residual);
+
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            const float* plane = &residual[channel * numPixels];
+            double sum = 0.0;
+            for (size_t spanIndex = 0; spanIndex < numSpans; ++spanIndex)
+            {
+                for (size_t pixelIndex = spans[spanIndex].m_start; pixelIndex < spans[spanIndex].m_start + spans[spanIndex].m_count; ++pixelIndex)
+                    sum += double(plane[pixelIndex]) * double(plane[pixelIndex]);
+            }
+            tileResidualLengthSquared[tileIndex * 3 + channel] = sum;
+        }
+    };
+
+    double inputLengthSquared[3];
+    StencilDotProduct(stencil, input, input, inputLengthSquared);
+
+    // The residual of SOR doesn't go down steadily, and can go up for a while at the start.
+    // So, to tell when float precision is keeping it from getting any smaller, look at how long it's been since it last got a good amount smaller.
+    double bestResidualLengthSquared[3] = { inputLengthSquared[0], inputLengthSquared[1], inputLengthSquared[2] };
+    int checksSinceBest[3] = { 0, 0, 0 };
+
+    SSolveMonitor monitor("sor", control, inputLengthSquared, 3, c_sorMaxIterations);
+    for (int iteration = 0; ; ++iteration)
+    {
+        // check the residual every so often, and when the last iteration has been done
+        if (iteration % c_sorCheckInterval == 0 || iteration >= monitor.m_maxIterations)
+        {
+            g_threadPool.ParallelFor(numTiles, residualTile);
+
+            double residualLengthSquared[3] = { 0.0, 0.0, 0.0 };
+            bool converged = true;
+            bool anyStalled = false;
+            for (int channel = 0; channel < 3; ++channel)
+            {
+                for (size_t tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+                    residualLengthSquared[channel] += tileResidualLengthSquared[tileIndex * 3 + channel];
+
+                if (residualLengthSquared[channel] < bestResidualLengthSquared[channel] * 0.81)
+                {
+                    bestResidualLengthSquared[channel] = residualLengthSquared[channel];
+                    checksSinceBest[channel] = 0;
+                }
+                else
+                {
+                    checksSinceBest[channel]++;
+                }
+
+                bool stalled = checksSinceBest[channel] >= c_sorStalledChecks;
+                bool withinTolerance = monitor.IsConverged(residualLengthSquared, channel);
+                converged = converged && (stalled || withinTolerance);
+                anyStalled = anyStalled || (stalled && !withinTolerance);
+            }
+            if (!monitor.Continue(iteration, residualLengthSquared, converged, anyStalled))
+                break;
+        }
+
+        g_threadPool.ParallelFor(numTiles, [&] (size_t tileIndex) { relaxTile(0, tileIndex); });
+        g_threadPool.ParallelFor(numTiles, [&] (size_t tileIndex) { relaxTile(1, tileIndex); });
+    }
+    return monitor.m_progress;
+}
+
+struct SSparseCholesky
+{
+    // The matrix factored as L * D * L^T, with its rows and columns reordered to keep L sparse.
+    // L is stored by column, without its diagonal, which is all ones.
+    std::vector<size_t> m_order;
+    std::vector<size_t> m_columnStarts;
+    std::vector<int> m_rowIndices;
+    std::vector<double> m_values;
+    std::vector<double> m_diagonal;
+};
+
+void NestedDissection (int width, std::vector<size_t>& pixels, size_t begin, size_t end, std::vector<size_t>& order)
+{
+    // Appends pixels[begin, end) to order so that eliminating them in that order makes little fill in.
+    // The pixels are split in two by a line across the middle of their bounding box. Neither half touches the other, so they are ordered first, independently,
+    // and the pixels on the line come last.
+    if (end - begin <= c_nestedDissectionLeafPixels)
+    {
+        order.insert(order.end(), pixels.begin() + begin, pixels.begin() + end);
+        return;
+    }
+
+    size_t minX = width, minY = -1, maxX = 0, maxY = 0;
+    for (size_t index = begin; index < end; ++index)
+    {
+        size_t x = pixels[index] % width;
+        size_t y = pixels[index] / width;
+        minX = std::min(minX, x);
+        minY = std::min(minY, y);
+        maxX = std::max(maxX, x);
+        maxY = std::max(maxY, y);
+    }
+
+    // split across the longer axis
+    bool splitX = (maxX - minX) >= (maxY - minY);
+    size_t split = splitX ? (minX + maxX) / 2 : (minY + maxY) / 2;
+    auto coordinate = [width, splitX] (size_t pixelIndex)
+    {
+        return splitX ? pixelIndex % width : pixelIndex / width;
+    };
+
+    auto firstEnd = std::partition(pixels.begin() + begin, pixels.begin() + end, [&] (size_t pixelIndex) { return coordinate(pixelIndex) < split; });
+    auto secondEnd = std::partition(firstEnd, pixels.begin() + end, [&] (size_t pixelIndex) { return coordinate(pixelIndex) > split; });
+    size_t first = firstEnd - pixels.begin();
+    size_t second = secondEnd - pixels.begin();
+
+    NestedDissection(width, pixels, begin, first, order);
+    NestedDissection(width, pixels, first, second, order);
+    order.insert(order.end(), pixels.begin() + second, pixels.begin() + end);
+}
+
+void MakeSparseCholesky (const SStencil& stencil, SSparseCholesky& cholesky)
+{
+    // This is the LDL^T factorization from Tim Davis' "LDL" package, with the matrix made on the fly from the stencil.
+    std::vector<size_t> pixels = stencil.m_solvePixels;
+    cholesky.m_order.clear();
+    NestedDissection(stencil.m_width, pixels, 0, pixels.size(), cholesky.m_order);
+
+    // find where each grid pixel is in the new order
+    const int n = int(cholesky.m_order.size());
+    std::vector<int> orderIndex(size_t(stencil.m_width) * size_t(stencil.m_height), -1);
+    for (int k = 0; k < n; ++k)
+        orderIndex[cholesky.m_order[k]] = k;
+
+    auto getNeighbors = [&] (int k, int neighbors[4])
+    {
+        size_t pixelIndex = cholesky.m_order[k];
+        neighbors[0] = orderIndex[pixelIndex - 1];
+        neighbors[1] = orderIndex[pixelIndex + 1];
+        neighbors[2] = orderIndex[pixelIndex - stencil.m_width];
+        neighbors[3] = orderIndex[pixelIndex + stencil.m_width];
+    };
+
+    // symbolic factorization: find the elimination tree, and how many values are in each column of L
+    std::vector<int> parent(n), columnCount(n), flag(n);
+    for (int k = 0; k < n; ++k)
+    {
+        parent[k] = -1;
+        flag[k] = k;
+        columnCount[k] = 0;
+
+        int neighbors[4];
+        getNeighbors(k, neighbors);
+        for (int i : neighbors)
+        {
+            if (i < 0 || i >= k)
+                continue;
+
+            for (; flag[i] != k; i = parent[i])
+            {
+                if (parent[i] == -1)
+                    parent[i] = k;
+                columnCount[i]++;
+                flag[i] = k;
+            }
+        }
+    }
+
+    cholesky.m_columnStarts.resize(n + 1);
+    cholesky.m_columnStarts[0] = 0;
+    for (int k = 0; k < n; ++k)
+        cholesky.m_columnStarts[k + 1] = cholesky.m_columnStarts[k] + columnCount[k];
+
+    // numeric factorization, one row of L at a time
+    size_t numValues = cholesky.m_columnStarts[n];
+    cholesky.m_rowIndices.resize(numValues);
+    cholesky.m_values.resize(numValues);
+    cholesky.m_diagonal.resize(n);
+
+    std::vector<double> y(n, 0.0);
+    std::vector<int> pattern(n);
+    for (int k = 0; k < n; ++k)
+    {
+        // scatter row k of the matrix into y, and find the pattern of row k of L by walking up the elimination tree
+        int top = n;
+        flag[k] = k;
+        columnCount[k] = 0;
+        y[k] = 4.0;
+
+        int neighbors[4];
+        getNeighbors(k, neighbors);
+        for (int i : neighbors)
+        {
+            if (i < 0 || i >= k)
+                continue;
+
+            y[i] -= 1.0;
+            int length = 0;
+            for (; flag[i] != k; i = parent[i])
+            {
+                pattern[length++] = i;
+                flag[i] = k;
+            }
+            while (length > 0)
+                pattern[--top] = pattern[--length];
+        }
+
+        // compute the values of row k of L, and the diagonal
+        double diagonal = y[k];
+        y[k] = 0.0;
+        for (; top < n; ++top)
+        {
+            int i = pattern[top];
+            double yi = y[i];
+            y[i] = 0.0;
+
+            size_t columnEnd = cholesky.m_columnStarts[i] + columnCount[i];
+            for (size_t p = cholesky.m_columnStarts[i]; p < columnEnd; ++p)
+                y[cholesky.m_rowIndices[p]] -= cholesky.m_values[p] * yi;
+
+            double value = yi / cholesky.m_diagonal[i];
+            diagonal -= value * yi;
+            cholesky.m_rowIndices[columnEnd] = k;
+            cholesky.m_values[columnEnd] = value;
+            columnCount[i]++;
+        }
+
+        // the matrix is positive definite, so this can't be zero unless something went very wrong
+        assert(diagonal > 0.0);
+        cholesky.m_diagonal[k] = diagonal;
+    }
+}
+
+void SolveSparseCholesky (const SSparseCholesky& cholesky, const std::vector<float>& input, std::vector<float>& output)
+{
+    // input and output are planar RGB values on the stencil grid. All three channels are solved in the same passes over L.
+    const size_t n = cholesky.m_order.size();
+    const size_t numPixels = input.size() / 3;
+    std::vector<double> x(n * 3);
+    for (size_t k = 0; k < n; ++k)
+    {
+        for (int channel = 0; channel < 3; ++channel)
+            x[k * 3 + channel] = input[channel * numPixels + cholesky.m_order[k]];
+    }
+
+    // solve L * x = input
+    for (size_t j = 0; j < n; ++j)
+    {
+        for (size_t p = cholesky.m_columnStarts[j]; p < cholesky.m_columnStarts[j + 1]; ++p)
+        {
+            double value = cholesky.m_values[p];
+            double* row = &x[size_t(cholesky.m_rowIndices[p]) * 3];
+            for (int channel = 0; channel < 3; ++channel)
+                row[channel] -= value * x[j * 3 + channel];
+        }
+    }
+
+    // solve D * x = x
+    for (size_t j = 0; j < n; ++j)
+    {
+        for (int channel = 0; channel < 3; ++channel)
+            x[j * 3 + channel] /= cholesky.m_diagonal[j];
+    }
+
+    // solve L^T * x = x
+    for (size_t j = n; j-- > 0;)
+    {
+        for (size_t p = cholesky.m_columnStarts[j]; p < cholesky.m_columnStarts[j + 1]; ++p)
+        {
+            double value = cholesky.m_values[p];
+            const double* row = &x[size_t(cholesky.m_rowIndices[p]) * 3];
+            for (int channel = 0; channel < 3; ++channel)
+                x[j * 3 + channel] -= value * row[channel];
+        }
+    }
+
+    output.resize(input.size(), 0.0f);
+    for (size_t k = 0; k < n; ++k)
+    {
+        for (int channel = 0; channel < 3; ++channel)
+            output[channel * numPixels + cholesky.m_order[k]] = float(x[k * 3 + channel]);
+    }
+}
+
+void MakeTiledCoarseStencil (const SBitMask& mask, SStencil& coarseStencil)
+{
+    // One coarse pixel for each c_tileCoarseBlock square block of the mask grid, which is solved for if every pixel in the block is.
+    // Solve pixels are never on the edge of the mask, so blocks on the edge of the coarse grid are never solved for, just like on the fine grid.
+    const int block = c_tileCoarseBlock;
+    coarseStencil = SStencil();
+    coarseStencil.m_width = (mask.m_width + block - 1) / block;
+    coarseStencil.m_height = (mask.m_height + block - 1) / block;
+
+    std::vector<int32_t> numSolvePixels(coarseStencil.NumPixels(), 0);
+    for (const SPixelSpan& span : mask.m_interiorSpans)
+    {
+        const size_t x = span.m_start % mask.m_width;
+        const size_t y = span.m_start / mask.m_width;
+        for (size_t index = 0; index < span.m_count; ++index)
+            numSolvePixels[(y / block) * coarseStencil.m_width + (x + index) / block]++;
+    }
+
+    for (size_t pixelIndex = 0; pixelIndex < numSolvePixels.size(); ++pixelIndex)
+    {
+        if (numSolvePixels[pixelIndex] == block * block)
+            coarseStencil.m_solvePixels.push_back(pixelIndex);
+    }
+    MakePixelSpans(coarseStencil.m_solvePixels, coarseStencil.m_width, coarseStencil.m_spans);
+    MakeMultigrid(coarseStencil);
+}
+
+struct STiledBuffers
+{
+    // The right hand side and the solution of a tiled solve, as planar RGB values on the mask grid, like the other stencil solvers use.
+    // They are kept in a scratch file so the OS can page out the parts that aren't being worked on. PoissonBlend makes the right hand side
+    // straight into it, and pastes the solution straight out of it, so there is never a copy of either of them in memory.
+    // If the scratch file can't be made, they are kept in memory instead, which is no more memory than the other solvers use.
+    SScratchFile m_scratch;
+    std::vector<float> m_memory;
+    float* m_input = nullptr;
+    float* m_solution = nullptr;
+    size_t m_numPixels = 0;
+
+    void Allocate (size_t numPixels)
+    {
+        // everything starts out zeroed
+        m_numPixels = numPixels;
+        if (m_scratch.Create(g_scratchDirectory, numPixels * 6 * sizeof(float)))
+        {
+            m_input = (float*)m_scratch.m_data;
+        }
+        else
+        {
+            printf(__FUNCTION__ "() error: Could not make a scratch file in %s, using memory instead\n", g_scratchDirectory);
+            m_memory.assign(numPixels * 6, 0.0f);
+            m_input = &m_memory[0];
+        }
+        m_solution = m_input + numPixels * 3;
+    }
+};
+
+SSolveProgress SolveTiled (const SStencil& coarseStencil, int tileSize, const SBitMask& mask, STiledBuffers& buffers, const SSolveControl& control)
+{
+    // Two level restricted Schwarz, for masks too big to solve all at once. Only a tile per thread and the coarse grid are solved in memory.
+    // The right hand side and the solution are in buffers, which is the size of the mask grid, and the solution starts out as zero.
+    //
+    // Each sweep solves every tile, plus an overlap with its neighbors, for the correction to the current solution, holding everything outside of that fixed.
+    // Only the pixels of the tile itself are updated. Tiles are done in four passes by whether their x and y tile index are odd, so that the tiles done
+    // at the same time are a tile apart, and never read pixels that another one is writing.
+    //
+    // Tiles only move information a tile or so each sweep, so before each sweep the residual is restricted to the coarse grid and solved there,
+    // and that correction is interpolated bilinearly between block centers and added to the solution. Like the multigrid levels, the coarse matrix
+    // is the five point stencil with the grid spacing made c_tileCoarseBlock times bigger, which makes it that many squared times smaller. Instead
+    // of scaling the coarse matrix, the restriction adds up the residual of about a block's worth of pixels for each coarse pixel.
+    const int width = mask.m_width;
+    const int height = mask.m_height;
+    const size_t numPixels = buffers.m_numPixels;
+    const float* input = buffers.m_input;
+    float* solution = buffers.m_solution;
+
+    double inputLengthSquared[3] = { 0.0, 0.0, 0.0 };
+    for (int channel = 0; channel < 3; ++channel)
+    {
+        for (const SPixelSpan& span : mask.m_interiorSpans)
+        {
+            const float* value = &input[channel * numPixels + span.m_start];
+            for (size_t index = 0; index < span.m_count; ++index)
+                inputLengthSquared[channel] += double(value[index]) * double(value[index]);
+        }
+    }
+
+    const int tilesX = (width + tileSize - 1) / tileSize;
+    const int tilesY = (height + tileSize - 1) / tileSize;
+    const size_t numTiles = size_t(tilesX) * size_t(tilesY);
+    std::vector<size_t> tilesOfParity[4];
+    for (size_t tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+        tilesOfParity[(tileIndex % tilesX) % 2 + ((tileIndex / tilesX) % 2) * 2].push_back(tileIndex);
+
+    auto getTileRect = [&] (size_t tileIndex, int overlap)
+    {
+        const int tileX = int(tileIndex % tilesX);
+        const int tileY = int(tileIndex / tilesX);
+        SRect rect;
+        rect.x1 = std::max(tileX * tileSize - overlap, 0);
+        rect.y1 = std::max(tileY * tileSize - overlap, 0);
+        rect.x2 = std::min((tileX + 1) * tileSize + overlap, width);
+        rect.y2 = std::min((tileY + 1) * tileSize + overlap, height);
+        return rect;
+    };
+
+    auto solveTile = [&] (size_t tileIndex)
+    {
+        // the tile's grid has a pixel around the overlapped region, which the stencil reads but never solves for
+        const SRect region = getTileRect(tileIndex, c_tileOverlap);
+        const SRect grid = { std::max(region.x1 - 1, 0), std::max(region.y1 - 1, 0), std::min(region.x2 + 1, width), std::min(region.y2 + 1, height) };
+        SStencil stencil;
+        stencil.m_width = grid.x2 - grid.x1;
+        stencil.m_height = grid.y2 - grid.y1;
+        ForEachSpanInRect(mask.m_interiorSpans, width, region,
+            [&] (int x, int y, int count)
+            {
+                for (int index = 0; index < count; ++index)
+                    stencil.m_solvePixels.push_back(size_t(y - grid.y1) * size_t(stencil.m_width) + size_t(x + index - grid.x1));
+            }
+        );
+        if (stencil.m_solvePixels.empty())
+            return;
+        MakePixelSpans(stencil.m_solvePixels, stencil.m_width, stencil.m_spans);
+        MakeMultigrid(stencil);
+
+        // the tile's right hand side is the residual of the current solution
+        const size_t numTilePixels = stencil.NumPixels();
+        std::vector<float> tileInput(numTilePixels * 3, 0.0f), tileOutput;
+        ForEachSpanInRect(mask.m_interiorSpans, width, region,
+            [&] (int x, int y, int count)
+            {
+                const size_t pixelIndex = size_t(y) * size_t(width) + size_t(x);
+                const size_t tilePixelIndex = size_t(y - grid.y1) * size_t(stencil.m_width) + size_t(x - grid.x1);
+                for (int channel = 0; channel < 3; ++channel)
+                    g_stencilKernels.m_residual(&input[channel * numPixels + pixelIndex], &solution[channel * numPixels + pixelIndex], &tileInput[channel * numTilePixels + tilePixelIndex], size_t(count), width);
+            }
+        );
+        SolvePreconditionedConjugateGradient(stencil, EPreconditioner::Multigrid, tileInput, tileOutput, SSolveControl());
+
+        ForEachSpanInRect(mask.m_interiorSpans, width, getTileRect(tileIndex, 0),
+            [&] (int x, int y, int count)
+            {
+                const size_t pixelIndex = size_t(y) * size_t(width) + size_t(x);
+                const size_t tilePixelIndex = size_t(y - grid.y1) * size_t(stencil.m_width) + size_t(x - grid.x1);
+                for (int channel = 0; channel < 3; ++channel)
+                {
+                    float* value = &solution[channel * numPixels + pixelIndex];
+                    const float* correction = &tileOutput[channel * numTilePixels + tilePixelIndex];
+                    for (int index = 0; index < count; ++index)
+                        value[index] += correction[index];
+                }
+            }
+        );
+    };
+
+    // Fine pixels are between the centers of four coarse blocks. This finds the nearest two block centers on one axis, and the weight of the second one.
+    // The blocks on the edge of the coarse grid are never solved for, so clamping to the grid is fine.
+    auto getCoarseSample = [] (int position, int coarseSize, int& coarse0, int& coarse1, float& weight)
+    {
+        const float coarse = (float(position) + 0.5f) / float(c_tileCoarseBlock) - 0.5f;
+        coarse0 = std::max(int(std::floor(coarse)), 0);
+        coarse1 = std::min(coarse0 + 1, coarseSize - 1);
+        weight = std::min(std::max(coarse - float(coarse0), 0.0f), 1.0f);
+    };
+
+    // Finds the residual of a tile, summing its squared length, and restricts it to the coarse grid by adding each pixel to the four nearest
+    // coarse pixels with the same weights the correction is interpolated with. Tiles of the same parity never add to the same coarse pixels.
+    const size_t numCoarsePixels = coarseStencil.NumPixels();
+    const size_t coarseWidth = size_t(coarseStencil.m_width);
+    std::vector<float> coarseInput(numCoarsePixels * 3, 0.0f), coarseOutput;
+    std::vector<double> tileResidualLengthSquared(numTiles * 3, 0.0);
+    auto residualTile = [&] (size_t tileIndex)
+    {
+        std::vector<float> residual(size_t(tileSize), 0.0f);
+        double* residualLengthSquared = &tileResidualLengthSquared[tileIndex * 3];
+        residualLengthSquared[0] = residualLengthSquared[1] = residualLengthSquared[2] = 0.0;
+        ForEachSpanInRect(mask.m_interiorSpans, width, getTileRect(tileIndex, 0),
+            [&] (int x, int y, int count)
+            {
+                const size_t pixelIndex = size_t(y) * size_t(width) + size_t(x);
+                int coarseY0, coarseY1;
+                float weightY;
+                getCoarseSample(y, coarseStencil.m_height, coarseY0, coarseY1, weightY);
+                for (int channel = 0; channel < 3; ++channel)
+                {
+                    g_stencilKernels.m_residual(&input[channel * numPixels + pixelIndex], &solution[channel * numPixels + pixelIndex], &residual[0], size_t(count), width);
+                    float* coarseRow0 = &coarseInput[channel * numCoarsePixels + size_t(coarseY0) * coarseWidth];
+                    float* coarseRow1 = &coarseInput[channel * numCoarsePixels + size_t(coarseY1) * coarseWidth];
+                    for (int index = 0; index < count; ++index)
+                    {
+                        const float value = residual[index];
+                        residualLengthSquared[channel] += double(value) * double(value);
+
+                        int coarseX0, coarseX1;
+                        float weightX;
+                        getCoarseSample(x + index, coarseStencil.m_width, coarseX0, coarseX1, weightX);
+                        const float top = value * (1.0f - weightY);
+                        const float bottom = value * weightY;
+                        coarseRow0[coarseX0] += top * (1.0f - weightX);
+                        coarseRow0[coarseX1] += top * weightX;
+                        coarseRow1[coarseX0] += bottom * (1.0f - weightX);
+                        coarseRow1[coarseX1] += bottom * weightX;
+                    }
+                }
+            }
+        );
+    };
+
+    // Adds the coarse correction to the solve pixels of a tile. Coarse pixels that aren't solved for are zero, so the correction fades out
+    // towards the edge of the solve region.
+    auto prolongateTile = [&] (size_t tileIndex)
+    {
+        ForEachSpanInRect(mask.m_interiorSpans, width, getTileRect(tileIndex, 0),
+            [&] (int x, int y, int count)
+            {
+                int coarseY0, coarseY1;
+                float weightY;
+                getCoarseSample(y, coarseStencil.m_height, coarseY0, coarseY1, weightY);
+                for (int channel = 0; channel < 3; ++channel)
+                {
+                    const float* coarseRow0 = &coarseOutput[channel * numCoarsePixels + size_t(coarseY0) * coarseWidth];
+                    const float* coarseRow1 = &coarseOutput[channel * numCoarsePixels + size_t(coarseY1) * coarseWidth];
+                    float* value = &solution[channel * numPixels + size_t(y) * size_t(width)];
+                    for (int pixelX = x; pixelX < x + count; ++pixelX)
+                    {
+                        int coarseX0, coarseX1;
+                        float weightX;
+                        getCoarseSample(pixelX, coarseStencil.m_width, coarseX0, coarseX1, weightX);
+                        const float top = coarseRow0[coarseX0] + (coarseRow0[coarseX1] - coarseRow0[coarseX0]) * weightX;
+                        const float bottom = coarseRow1[coarseX0] + (coarseRow1[coarseX1] - coarseRow1[coarseX0]) * weightX;
+                        value[pixelX] += top + (bottom - top) * weightY;
+                    }
+                }
+            }
+        );
+    };
+
+    // The residual of the sweeps doesn't go down steadily, and the first sweeps make it a lot bigger than the right hand side as the solution
+    // goes from zero to the size of the pixel values. So, to tell when float precision is keeping it from getting any smaller,
+    // look at how long it's been since it last got a good amount smaller than the smallest it's been since the first sweep.
+    // Sweeping only stops early once a channel that is still above the tolerance has gone c_tileStalledSweeps sweeps like that,
+    // and then the solve stops as stalled, not as converged.
+    double bestResidualLengthSquared[3] = { 0.0, 0.0, 0.0 };
+    int sweepsSinceBest[3] = { 0, 0, 0 };
+    SSolveMonitor monitor("tiled", control, inputLengthSquared, 3, c_tileMaxSweeps);
+    for (int sweep = 0; ; ++sweep)
+    {
+        std::fill(coarseInput.begin(), coarseInput.end(), 0.0f);
+        for (const std::vector<size_t>& tiles : tilesOfParity)
+            g_threadPool.ParallelFor(tiles.size(), [&] (size_t index) { residualTile(tiles[index]); });
+
+        double residualLengthSquared[3] = { 0.0, 0.0, 0.0 };
+        bool converged = true;
+        bool anyStalled = false;
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            for (size_t tileIndex = 0; tileIndex < numTiles; ++tileIndex)
+                residualLengthSquared[channel] += tileResidualLengthSquared[tileIndex * 3 + channel];
+
+            if (sweep <= 1 || residualLengthSquared[channel] < bestResidualLengthSquared[channel] * 0.81)
+            {
+                bestResidualLengthSquared[channel] = residualLengthSquared[channel];
+                sweepsSinceBest[channel] = 0;
+            }
+            else
+            {
+                sweepsSinceBest[channel]++;
+            }
+
+            bool withinTolerance = monitor.IsConverged(residualLengthSquared, channel);
+            bool stalled = !withinTolerance && sweepsSinceBest[channel] >= c_tileStalledSweeps;
+            converged = converged && (stalled || withinTolerance);
+            anyStalled = anyStalled || stalled;
+        }
+        if (!monitor.Continue(sweep, residualLengthSquared, converged, anyStalled))
+            break;
+
+        // solve for the coarse correction. The restricted residual needs to be zero where the coarse grid isn't solved for, like any other stencil vector.
+        if (!coarseStencil.m_solvePixels.empty())
+        {
+            std::vector<bool> isCoarseSolvePixel(numCoarsePixels, false);
+            for (size_t pixelIndex : coarseStencil.m_solvePixels)
+                isCoarseSolvePixel[pixelIndex] = true;
+            for (int channel = 0; channel < 3; ++channel)
+            {
+                for (size_t pixelIndex = 0; pixelIndex < numCoarsePixels; ++pixelIndex)
+                    coarseInput[channel * numCoarsePixels + pixelIndex] = isCoarseSolvePixel[pixelIndex] ? coarseInput[channel * numCoarsePixels + pixelIndex] : 0.0f;
+            }
+            SolvePreconditionedConjugateGradient(coarseStencil, EPreconditioner::Multigrid, coarseInput, coarseOutput, SSolveControl());
+
+            g_threadPool.ParallelFor(numTiles, prolongateTile);
+        }
+
+        for (const std::vector<size_t>& tiles : tilesOfParity)
+            g_threadPool.ParallelFor(tiles.size(), [&] (size_t index) { solveTile(tiles[index]); });
+    }
+    return monitor.m_progress;
+}
+
+struct SMaskPlan
+{
+    // Everything about the linear system that only depends on the mask, so it can be made once and re-used for any source and destination images.
+    // Only the parts needed by the solver are made.
+    uint64_t m_hash = 0;
+    ESolver m_solver = ESolver::Dense;
+    EPreconditioner m_preconditioner = EPreconditioner::None;
+    size_t m_numSolvePixels = 0;
+
+    // The mask the plan was made for. Plans are found by the hash of their mask, so these are checked too, in case two masks hash the same.
+    int m_maskWidth = 0;
+    int m_maskHeight = 0;
+    size_t m_numMaskPixels = 0;
+
+    bool IsFor (const SBitMask& mask, size_t numMaskPixels, size_t numSolvePixels, ESolver solver) const
+    {
+        return m_maskWidth == mask.m_width && m_maskHeight == mask.m_height && m_numMaskPixels == numMaskPixels &&
+            m_numSolvePixels == numSolvePixels && m_solver == solver;
+    }
+
+    // ESolver::Dense
+    std::vector<float> m_matrixInverted;
+
+    // ESolver::ConjugateGradient
+    SSparseMatrix m_matrix;
+
+    // ESolver::PreconditionedConjugateGradient, ESolver::Multigrid, ESolver::SparseCholesky and ESolver::RedBlackSOR
+    SStencil m_stencil;
+
+    // ESolver::SparseCholesky
+    SSparseCholesky m_cholesky;
+
+    // ESolver::Tiled
+    int m_tileSize = 0;
+    SStencil m_coarseStencil;
+};
+
+// bump this when the contents of SMaskPlan, or the way they are made, change, so old plans on disk are ignored
+const uint32_t c_maskPlanVersion = 5;
+
+bool ParseSolver (const char* name, ESolver& solver)
+{
+    // Tiled has no name, since it's turned on with -tilesize
+    for (int index = 0; index <= int(ESolver::RedBlackSOR); ++index)
+    {
+        if (!strcmp(name, c_solverNames[index]))
+        {
+            solver = ESolver(index);
+            return true;
+        }
+    }
+    return false;
+}
+
+ESolver GetSolver (const SBitMask& mask)
+{
+    // masks bigger than a tile are solved a tile at a time, if tiles are turned on
+    if (g_tileSize > 0 && (mask.m_width > g_tileSize || mask.m_height > g_tileSize))
+        return ESolver::Tiled;
+    return g_solver;
+}
+
+uint64_t HashMask (const SBitMask& mask, ESolver solver, EPreconditioner preconditioner, int tileSize)
+{
+    // FNV-1a of the mask size, the solver settings, and which mask pixels are on
+    uint64_t hash = 14695981039346656037ull;
+    auto hashBytes = [&hash] (const void* data, size_t size)
+    {
+        hash = HashBytes(hash, data, size);
+    };
+
+    hashBytes(&c_maskPlanVersion, sizeof(c_maskPlanVersion));
+    hashBytes(&mask.m_width, sizeof(mask.m_width));
+    hashBytes(&mask.m_height, sizeof(mask.m_height));
+    hashBytes(&solver, sizeof(solver));
+    hashBytes(&preconditioner, sizeof(preconditioner));
+    hashBytes(&tileSize, sizeof(tileSize));
+    hashBytes(mask.m_bits.data(), mask.m_bits.size() * sizeof(mask.m_bits[0]));
+    return hash;
+}
+
+template <typename T>
+void WritePlanValue (FILE* file, const T& value)
+{
+    fwrite(&value, sizeof(value), 1, file);
+}
+
+template <typename T>
+bool ReadPlanValue (FILE* file, T& value)
+{
+    return fread(&value, sizeof(value), 1, file) == 1;
+}
+
+template <typename T>
+void WritePlanVector (FILE* file, const std::vector<T>& values)
+{
+    WritePlanValue(file, uint64_t(values.size()));
+    if (!values.empty())
+        fwrite(&values[0], sizeof(T), values.size(), file);
+}
+
+inline uint64_t PlanBytesLeft (FILE* file)
+{
+    long position = ftell(file);
+    if (position < 0 || fseek(file, 0, SEEK_END) != 0)
+        return 0;
+    long end = ftell(file);
+    fseek(file, position, SEEK_SET);
+    return (end > position) ? uint64_t(end - position) : 0;
+}
+
+template <typename T>
+bool ReadPlanVector (FILE* file, std::vector<T>& values)
+{
+    // a size bigger than what's left of the file means the file is damaged or cut short
+    uint64_t size = 0;
+    if (!ReadPlanValue(file, size) || size > PlanBytesLeft(file) / sizeof(T))
+        return false;
+    values.resize(size_t(size));
+    return values.empty() || fread(&values[0], sizeof(T), values.size(), file) == values.size();
+}
+
+void WritePlanStencil (FILE* file, const SStencil& stencil)
+{
+    WritePlanValue(file, stencil.m_width);
+    WritePlanValue(file, stencil.m_height);
+    WritePlanVector(file, stencil.m_solvePixels);
+    WritePlanVector(file, stencil.m_spans);
+    WritePlanVector(file, stencil.m_incompleteCholesky);
+    WritePlanValue(file, uint64_t(stencil.m_multigrid.size()));
+    for (const SMultigridLevel& level : stencil.m_multigrid)
+    {
+        WritePlanValue(file, level.m_width);
+        WritePlanValue(file, level.m_height);
+        WritePlanVector(file, level.m_spans);
+        WritePlanVector(file, level.m_redBoundaryPixels);
+        WritePlanVector(file, level.m_blackBoundaryPixels);
+    }
+}
+
+bool ReadPlanStencil (FILE* file, SStencil& stencil)
+{
+    uint64_t numLevels = 0;
+    bool success =
+        ReadPlanValue(file, stencil.m_width) &&
+        ReadPlanValue(file, stencil.m_height) &&
+        ReadPlanVector(file, stencil.m_solvePixels) &&
+        ReadPlanVector(file, stencil.m_spans) &&
+        ReadPlanVector(file, stencil.m_incompleteCholesky) &&
+        ReadPlanValue(file, numLevels);
+
+    if (success)
+    {
+        stencil.m_multigrid.resize(size_t(numLevels));
+        for (SMultigridLevel& level : stencil.m_multigrid)
+        {
+            success = success &&
+                ReadPlanValue(file, level.m_width) &&
+                ReadPlanValue(file, level.m_height) &&
+                ReadPlanVector(file, level.m_spans) &&
+                ReadPlanVector(file, level.m_redBoundaryPixels) &&
+                ReadPlanVector(file, level.m_blackBoundaryPixels);
+        }
+    }
+    return success;
+}
+
+void MaskPlanFileName (const char* cacheDirectory, uint64_t hash, char* fileName, size_t fileNameSize)
+{
+    snprintf(fileName, fileNameSize, "%s/%016llx.plan", cacheDirectory, (unsigned long long)hash);
+}
+
+bool SaveMaskPlan (const SMaskPlan& plan, const char* cacheDirectory)
+{
+    char fileName[1024];
+    MaskPlanFileName(cacheDirectory, plan.m_hash, fileName, sizeof(fileName));
+    FILE* file = fopen(fileName, "wb");
+    if (!file)
+        return false;
+
+    WritePlanValue(file, c_maskPlanVersion);
+    WritePlanValue(file, plan.m_hash);
+    WritePlanValue(file, plan.m_solver);
+    WritePlanValue(file, plan.m_preconditioner);
+    WritePlanValue(file, uint64_t(plan.m_numSolvePixels));
+    WritePlanValue(file, plan.m_maskWidth);
+    WritePlanValue(file, plan.m_maskHeight);
+    WritePlanValue(file, uint64_t(plan.m_numMaskPixels));
+
+    WritePlanVector(file, plan.m_matrixInverted);
+
+    WritePlanValue(file, uint64_t(plan.m_matrix.m_dimension));
+    WritePlanVector(file, plan.m_matrix.m_neighbors);
+
+    WritePlanStencil(file, plan.m_stencil);
+
+    WritePlanVector(file, plan.m_cholesky.m_order);
+    WritePlanVector(file, plan.m_cholesky.m_columnStarts);
+    WritePlanVector(file, plan.m_cholesky.m_rowIndices);
+    WritePlanVector(file, plan.m_cholesky.m_values);
+    WritePlanVector(file, plan.m_cholesky.m_diagonal);
+
+    WritePlanValue(file, plan.m_tileSize);
+    WritePlanStencil(file, plan.m_coarseStencil);
+
+    bool success = ferror(file) == 0;
+    fclose(file);
+    return success;
+}
+
+bool LoadMaskPlan (SMaskPlan& plan, uint64_t hash, const char* cacheDirectory)
+{
+    char fileName[1024];
+    MaskPlanFileName(cacheDirectory, hash, fileName, sizeof(fileName));
+    FILE* file = fopen(fileName, "rb");
+    if (!file)
+        return false;
+
+    uint32_t version = 0;
+    uint64_t numSolvePixels = 0, numMaskPixels = 0, matrixDimension = 0;
+    bool success =
+        ReadPlanValue(file, version) && version == c_maskPlanVersion &&
+        ReadPlanValue(file, plan.m_hash) && plan.m_hash == hash &&
+        ReadPlanValue(file, plan.m_solver) &&
+        ReadPlanValue(file, plan.m_preconditioner) &&
+        ReadPlanValue(file, numSolvePixels) &&
+        ReadPlanValue(file, plan.m_maskWidth) &&
+        ReadPlanValue(file, plan.m_maskHeight) &&
+        ReadPlanValue(file, numMaskPixels) &&
+        ReadPlanVector(file, plan.m_matrixInverted) &&
+        ReadPlanValue(file, matrixDimension) &&
+        ReadPlanVector(file, plan.m_matrix.m_neighbors) &&
+        ReadPlanStencil(file, plan.m_stencil) &&
+        ReadPlanVector(file, plan.m_cholesky.m_order) &&
+        ReadPlanVector(file, plan.m_cholesky.m_columnStarts) &&
+        ReadPlanVector(file, plan.m_cholesky.m_rowIndices) &&
+        ReadPlanVector(file, plan.m_cholesky.m_values) &&
+        ReadPlanVector(file, plan.m_cholesky.m_diagonal) &&
+        ReadPlanValue(file, plan.m_tileSize) &&
+        ReadPlanStencil(file, plan.m_coarseStencil);
+
+    plan.m_numSolvePixels = size_t(numSolvePixels);
+    plan.m_numMaskPixels = size_t(numMaskPixels);
+    plan.m_matrix.m_dimension = size_t(matrixDimension);
+
+    fclose(file);
+    return success;
+}
+
+void MakeMaskPlan (const SBitMask& mask, size_t numSolvePixels, const std::vector<int32_t>& pixelIndexToMatrixColumn, ESolver solver, SMaskPlan& plan)
+{
+    plan.m_solver = solver;
+    plan.m_numSolvePixels = numSolvePixels;
+
+    switch (solver)
+    {
+        case ESolver::Dense:
+        {
+            // invert the matrix, so solving is just a matrix multiply
+            SSparseMatrix matrix;
+            std::vector<float> denseMatrix;
+            MakeSparseMatrix(mask, numSolvePixels, pixelIndexToMatrixColumn, matrix);
+            SparseMatrixToDense(matrix, denseMatrix);
+            InvertMatrixDestructive(numSolvePixels, denseMatrix, plan.m_matrixInverted);
+            break;
+        }
+        case ESolver::ConjugateGradient:
+        {
+            // make the sparse matrix. Only the five point stencil of each row is stored, since every other value is zero.
+            MakeSparseMatrix(mask, numSolvePixels, pixelIndexToMatrixColumn, plan.m_matrix);
+            break;
+        }
+        case ESolver::PreconditionedConjugateGradient:
+        case ESolver::Multigrid:
+        {
+            // the multigrid solver needs the same pyramid that the multigrid preconditioner does
+            plan.m_preconditioner = (solver == ESolver::Multigrid) ? EPreconditioner::Multigrid : c_preconditioner;
+            MakeStencil(mask, numSolvePixels, pixelIndexToMatrixColumn, plan.m_preconditioner, plan.m_stencil);
+            break;
+        }
+        case ESolver::RedBlackSOR:
+        {
+            MakeStencil(mask, numSolvePixels, pixelIndexToMatrixColumn, EPreconditioner::None, plan.m_stencil);
+            break;
+        }
+        case ESolver::SparseCholesky:
+        {
+            MakeStencil(mask, numSolvePixels, pixelIndexToMatrixColumn, EPreconditioner::None, plan.m_stencil);
+            MakeSparseCholesky(plan.m_stencil, plan.m_cholesky);
+            break;
+        }
+        case ESolver::Tiled:
+        {
+            // the tiles are made as they are solved, so that the whole mask is never in memory at once. Only the coarse grid is kept.
+            plan.m_tileSize = g_tileSize;
+            MakeTiledCoarseStencil(mask, plan.m_coarseStencil);
+            break;
+        }
+    }
+}
+
+const SMaskPlan& GetMaskPlan (const SBitMask& mask, size_t numSolvePixels, const std::vector<int32_t>& pixelIndexToMatrixColumn, const char* cacheDirectory)
+{
+    // Plans are cached in memory by the hash of the mask, and also on disk if there is a cache directory.
+    static std::unordered_map<uint64_t, std::unique_ptr<SMaskPlan>> s_maskPlans;
+
+    ESolver solver = GetSolver(mask);
+    uint64_t hash = HashMask(mask, solver, c_preconditioner, (solver == ESolver::Tiled) ? g_tileSize : 0);
+    size_t numMaskPixels = 0;
+    for (const SPixelSpan& span : mask.m_spans)
+        numMaskPixels += span.m_count;
+
+    std::unique_ptr<SMaskPlan>& plan = s_maskPlans[hash];
+    if (plan && plan->IsFor(mask, numMaskPixels, numSolvePixels, solver))
+        return *plan;
+
+    plan.reset(new SMaskPlan);
+    if (cacheDirectory && LoadMaskPlan(*plan, hash, cacheDirectory) && plan->IsFor(mask, numMaskPixels, numSolvePixels, solver))
+        return *plan;
+
+    *plan = SMaskPlan();
+    plan->m_hash = hash;
+    plan->m_maskWidth = mask.m_width;
+    plan->m_maskHeight = mask.m_height;
+    plan->m_numMaskPixels = numMaskPixels;
+    MakeMaskPlan(mask, numSolvePixels, pixelIndexToMatrixColumn, solver, *plan);
+
+    if (cacheDirectory && !SaveMaskPlan(*plan, cacheDirectory))
+        printf(__FUNCTION__ "() error: Could not write the mask plan to %s\n", cacheDirectory);
+
+    return *plan;
+}
+
+inline const float* GetSourceRows (const SImageChannel<const float>& channel, int x, int y, size_t, std::vector<float>&, ptrdiff_t& rowStride)
+{
+    // float rows can be read in place
+    rowStride = ptrdiff_t(channel.m_pitch);
+    return channel.GetRow(y) + x;
+}
+
+template <typename T>
+const float* GetSourceRows (const SImageChannel<const T>& channel, int x, int y, size_t count, std::vector<float>& buffer, ptrdiff_t& rowStride)
+{
+    // Other types are turned into floats. The divergence kernel reads from x - 1 to x + count + 1, on the rows from y - 1 to y + 2.
+    rowStride = ptrdiff_t(count + 3);
+    buffer.resize(size_t(rowStride) * 4);
+    for (int row = 0; row < 4; ++row)
+    {
+        const T* in = channel.GetRow(y - 1 + row) + x - 1;
+        float* out = &buffer[size_t(row) * size_t(rowStride)];
+        for (ptrdiff_t index = 0; index < rowStride; ++index)
+            out[index] = LoadValue(in[index]);
+    }
+    return &buffer[size_t(rowStride) + 1];
+}
+
+const float* GetDestinationRows (const SImageInfo& dest, int channel, int x, int y, size_t count, std::vector<float>& buffer, ptrdiff_t& rowStride)
+{
+    // The mixed divergence kernel reads the destination from x to x + count + 1, on the rows from y to y + 2.
+    // The coordinates are clamped to the destination, so the destination gradients off of its edges are zero.
+    rowStride = ptrdiff_t(count + 2);
+    buffer.resize(size_t(rowStride) * 3);
+    for (int row = 0; row < 3; ++row)
+    {
+        const int destY = std::min(std::max(y + row, 0), dest.m_height - 1);
+        float* out = &buffer[size_t(row) * size_t(rowStride)];
+        for (ptrdiff_t index = 0; index < rowStride; ++index)
+        {
+            const int destX = std::min(std::max(x + int(index), 0), dest.m_width - 1);
+            out[index] = dest.m_pixels[dest.PixelOffset(destX, destY, channel)];
+        }
+    }
+    return &buffer[0];
+}
+
+template <typename TImage, typename TGetOutput>
+void MakeInputVectors (const SPlanarImage<TImage>& source, const SBitMask& mask, const SImageInfo& dest, int pasteX, int pasteY, const std::vector<int32_t>& pixelIndexToMatrixColumn, const TGetOutput& getOutput)
+{
+    // Make the input vectors a run of solve pixels at a time, straight from the source image, without making the gradient image.
+    // getOutput(channel, span, matrixColumn) returns where to write the values of a channel for an interior span, whose first solve pixel is matrixColumn.
+    // The solve pixels of each interior span are consecutive matrix columns. For each pixel, it's the sum of the gradients, but the gradients
+    // from the pixel FORWARD are negative. This is just because of how we set up the equation for each line:
+    // 4 * Pixel - Left - Right - Up - Down = DeltaLeft - DeltaRight + DeltaUp - DeltaDown
+    // there are other ways we could have set up each equation (line) that are equivelant
+    //
+    // The gradient at a pixel is the difference to the pixel after it on x and on y, like MakeImageGradient makes.
+    // It's zero where the mask is off, and, like MakeImageGradient, for every pixel from (width - 1) * (height - 1) on.
+    //
+    // With mixed guidance, each gradient is the stronger of that one and the gradient of the destination pixels under it, before the solved pixels are pasted.
+    //
+    // Anything which has a negative matrix index is a boundary condition pixel and must be ADDED to the right side of the equation (aka the input vector!) from the source image.
+    // The weights make that choice without branching.
+    const size_t width = mask.m_width;
+    const size_t gradientEnd = (width - 1) * size_t(mask.m_height - 1);
+    std::vector<float> weights, sourceRows, destinationRows;
+    size_t matrixColumn = 0;
+    for (const SPixelSpan& span : mask.m_interiorSpans)
+    {
+        const int x = int(span.m_start % width);
+        const int y = int(span.m_start / width);
+        const size_t weightStride = span.m_count + 1;
+        weights.resize(weightStride * 6);
+        for (size_t index = 0; index <= span.m_count; ++index)
+        {
+            const size_t pixelIndex = span.m_start + index;
+            weights[index] = (mask.Get(x + int(index), y) && pixelIndex < gradientEnd) ? 1.0f : 0.0f;
+        }
+        for (size_t index = 0; index < span.m_count; ++index)
+        {
+            const size_t pixelIndex = span.m_start + index;
+            weights[weightStride + index] = (mask.Get(x + int(index), y + 1) && pixelIndex + width < gradientEnd) ? 1.0f : 0.0f;
+            weights[weightStride * 2 + index] = pixelIndexToMatrixColumn[pixelIndex - 1] < 0 ? 1.0f : 0.0f;
+            weights[weightStride * 3 + index] = pixelIndexToMatrixColumn[pixelIndex + 1] < 0 ? 1.0f : 0.0f;
+            weights[weightStride * 4 + index] = pixelIndexToMatrixColumn[pixelIndex - width] < 0 ? 1.0f : 0.0f;
+            weights[weightStride * 5 + index] = pixelIndexToMatrixColumn[pixelIndex + width] < 0 ? 1.0f : 0.0f;
+        }
+
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            ptrdiff_t rowStride = 0;
+            const float* sourceRow = GetSourceRows(source.GetChannel(channel), x, y, span.m_count, sourceRows, rowStride);
+            float* output = getOutput(channel, span, matrixColumn);
+            if (g_guidance == EGuidance::Mixed)
+            {
+                ptrdiff_t destinationRowStride = 0;
+                const float* destinationRow = GetDestinationRows(dest, channel, pasteX + x, pasteY + y, span.m_count, destinationRows, destinationRowStride);
+                g_stencilKernels.m_mixedDivergence(sourceRow, rowStride, destinationRow, destinationRowStride, &weights[0], weightStride, output, span.m_count);
+            }
+            else
+            {
+                g_stencilKernels.m_divergence(sourceRow, rowStride, &weights[0], weightStride, output, span.m_count);
+            }
+        }
+        matrixColumn += span.m_count;
+    }
+}
+
+struct SBlendInput
+{
+    // The right hand side of a blend's solve. It's the input vectors, except for the tiled solver, which has it on the mask grid in a scratch file.
+    std::vector<float> m_inputVectors[3];
+    STiledBuffers m_tiled;
+};
+
+template <typename TImage>
+void MakeBlendInput (const SPlanarImage<TImage>& source, const SBitMask& mask, const SImageInfo& dest, int pasteX, int pasteY, const SMaskPlan& plan, const std::vector<int32_t>& pixelIndexToMatrixColumn, SBlendInput& input)
+{
+    // The source image is stored as whatever type the precision policy uses, and is turned into floats as it is read.
+    if (plan.m_solver == ESolver::Tiled)
+    {
+        const size_t numPixels = size_t(mask.m_width) * size_t(mask.m_height);
+        input.m_tiled.Allocate(numPixels);
+        MakeInputVectors(source, mask, dest, pasteX, pasteY, pixelIndexToMatrixColumn,
+            [&] (int channel, const SPixelSpan& span, size_t)
+            {
+                return &input.m_tiled.m_input[size_t(channel) * numPixels + span.m_start];
+            }
+        );
+        return;
+    }
+
+    for (int channel = 0; channel < 3; ++channel)
+        input.m_inputVectors[channel].assign(plan.m_numSolvePixels, 0.0f);
+    MakeInputVectors(source, mask, dest, pasteX, pasteY, pixelIndexToMatrixColumn,
+        [&] (int channel, const SPixelSpan&, size_t matrixColumn)
+        {
+            return &input.m_inputVectors[channel][matrixColumn];
+        }
+    );
+}
+
+void PoissonBlend (const SBitMask& mask, SImageInfo& dest, int pasteX, int pasteY, const SMaskPlan& plan, const std::vector<int32_t>& pixelIndexToMatrixColumn, SBlendInput& input)
+{
+    // The plan has everything about the matrix, and MakeBlendInput made the right hand side, so all we need to do is solve.
+    // The solved pixels are pasted into the destination image.
+    size_t numSolvePixels = plan.m_numSolvePixels;
+    const std::vector<float> (&inputVectors)[3] = input.m_inputVectors;
+
+    // The tiled solver works on the mask grid, which it keeps in a scratch file, and the solution is pasted straight off of it
+    if (plan.m_solver == ESolver::Tiled)
+    {
+        STiledBuffers& buffers = input.m_tiled;
+        g_report.AddSolve(SolveTiled(plan.m_coarseStencil, plan.m_tileSize, mask, buffers, g_solveControl));
+        PasteSolvedPixels(mask,
+            [&] (int channel, int x, int y)
+            {
+                return &buffers.m_solution[size_t(channel) * buffers.m_numPixels + size_t(y) * size_t(mask.m_width) + size_t(x)];
+            },
+            dest, pasteX, pasteY
+        );
+        return;
+    }
+
+    // solve the system for each color channel
+    std::vector<float> outputVectors[3];
+    switch (plan.m_solver)
+    {
+        case ESolver::Dense:
+        {
+            for (int channel = 0; channel < 3; ++channel)
+                MatrixMultiply(plan.m_matrixInverted, inputVectors[channel], outputVectors[channel]);
+            break;
+        }
+        case ESolver::ConjugateGradient:
+        {
+            for (int channel = 0; channel < 3; ++channel)
+                g_report.AddSolve(SolveConjugateGradient(plan.m_matrix, inputVectors[channel], outputVectors[channel], g_solveControl, channel));
+            break;
+        }
+        case ESolver::PreconditionedConjugateGradient:
+        case ESolver::Multigrid:
+        case ESolver::SparseCholesky:
+        case ESolver::RedBlackSOR:
+        {
+            const SStencil& stencil = plan.m_stencil;
+
+            // put the input vectors onto the stencil grid, solve, and take the results back off of it
+            std::vector<float> input, output;
+            const size_t numPixels = stencil.NumPixels();
+            input.resize(numPixels * 3, 0.0f);
+            for (int channel = 0; channel < 3; ++channel)
+            {
+                for (size_t matrixColumn = 0; matrixColumn < numSolvePixels; ++matrixColumn)
+                    input[channel * numPixels + stencil.m_solvePixels[matrixColumn]] = inputVectors[channel][matrixColumn];
+            }
+
+            // the direct solver has no iterations to report
+            if (plan.m_solver == ESolver::Multigrid)
+                g_report.AddSolve(SolveMultigrid(stencil, input, output, g_solveControl));
+            else if (plan.m_solver == ESolver::SparseCholesky)
+                SolveSparseCholesky(plan.m_cholesky, input, output);
+            else if (plan.m_solver == ESolver::RedBlackSOR)
+                g_report.AddSolve(SolveRedBlackSOR(stencil, input, output, g_solveControl));
+            else
+                g_report.AddSolve(SolvePreconditionedConjugateGradient(stencil, plan.m_preconditioner, input, output, g_solveControl));
+
+            for (int channel = 0; channel < 3; ++channel)
+            {
+                outputVectors[channel].resize(numSolvePixels);
+                for (size_t matrixColumn = 0; matrixColumn < numSolvePixels; ++matrixColumn)
+                    outputVectors[channel][matrixColumn] = output[channel * numPixels + stencil.m_solvePixels[matrixColumn]];
+            }
+            break;
+        }
+        case ESolver::Tiled:
+        {
+            // solved above
+            break;
+        }
+    }
+
+    // paste the solved pixels onto the destination image. The solved pixels of an interior run are consecutive in the output vectors.
+    PasteSolvedPixels(mask,
+        [&] (int channel, int x, int y)
+        {
+            return &outputVectors[channel][size_t(pixelIndexToMatrixColumn[size_t(y) * size_t(mask.m_width) + size_t(x)])];
+        },
+        dest, pasteX, pasteY
+    );
+}
+
+template <typename T>
+void MakeImageGradient(const SImageInfo& source, const SBitMask& mask, const SImageInfo& dest, int pasteX, int pasteY, std::vector<T>& sourceGradient)
+{
+    // allocate space for the gradients, which are stored as T
+    sourceGradient.assign(source.m_width*source.m_height * 6, T());
+
+    // With mixed guidance, each gradient is the stronger of the source's and the destination's, like PoissonBlend uses.
+    // The destination is read with its coordinates clamped, so its gradients off of its edges are zero.
+    auto destValue = [&] (int x, int y, int channel)
+    {
+        x = std::min(std::max(x + pasteX, 0), dest.m_width - 1);
+        y = std::min(std::max(y + pasteY, 0), dest.m_height - 1);
+        return dest.m_pixels[dest.PixelOffset(x, y, channel)];
+    };
+    const bool mixed = (g_guidance == EGuidance::Mixed);
+
+    // make the gradients!
+    const float* sourcePixel = &source.m_pixels[0];
+    const float* sourcePixelNextRow = sourcePixel + source.m_width * source.m_channels;
+    // The pointers move on by one pixel for every x, including from the end of one row to the next, so the mask is read the same way
+    int maskX = 0;
+    int maskY = 0;
+
+    T* destPixel = &sourceGradient[0];
+    for (int y = 0; y < source.m_height-1; ++y)
+    {
+        for (int x = 0; x < source.m_width-1; ++x)
+        {
+            if (mask.Get(maskX, maskY) && mixed)
+            {
+                for (int channel = 0; channel < 3; ++channel)
                 {
-                    matrix[otherRowBegin + index] -= matrix[rowBegin + index] * scale;
-                    matrixInverted[otherRowBegin + index] -= matrixInverted[rowBegin + index] * scale;
+                    const float center = destValue(maskX, maskY, channel);
+                    StoreValue(MixGradient(sourcePixel[3 + channel] - sourcePixel[channel], destValue(maskX + 1, maskY, channel) - center), destPixel[channel]);
+                    StoreValue(MixGradient(sourcePixelNextRow[channel] - sourcePixel[channel], destValue(maskX, maskY + 1, channel) - center), destPixel[3 + channel]);
+                }
+            }
+            else if (mask.Get(maskX, maskY))
+            {
+                // calculate RGB dfdx
+                StoreValue(sourcePixel[3] - sourcePixel[0], destPixel[0]);
+                StoreValue(sourcePixel[4] - sourcePixel[1], destPixel[1]);
+                StoreValue(sourcePixel[5] - sourcePixel[2], destPixel[2]);
+
+                // calculate RGB dfdy
+                StoreValue(sourcePixelNextRow[0] - sourcePixel[0], destPixel[3]);
+                StoreValue(sourcePixelNextRow[1] - sourcePixel[1], destPixel[4]);
+                StoreValue(sourcePixelNextRow[2] - sourcePixel[2], destPixel[5]);
+            }
+            else
+            {
+                memset(destPixel, 0, sizeof(T) * 6);
+            }
+
+            // move to the next pixels
+            sourcePixel += 3;
+            sourcePixelNextRow += 3;
+            if (++maskX == mask.m_width)
+            {
+                maskX = 0;
+                maskY++;
+            }
+            destPixel += 6;
+        }
+    }
+}
+
+template <typename T>
+void SaveImageGradient(const SImageInfo& source, const SBitMask& mask, const std::vector<T>& sourceGradient, const char* fileName)
+{
+    // Save the gradient as a side by side double wide image.
+    // The left side is the x axis partial derivatives, the right side is the y axis.
+    std::vector<float> outPixels;
+    outPixels.resize((source.m_width * 3 * source.m_height) * 3);
+
+    const float* sourcePixel0 = &source.m_pixels[0];
+    const T* sourcePixel1 = &sourceGradient[0];
+
+    for (int y = 0; y < source.m_height; ++y)
+    {
+        float* destPixel0 = &outPixels[y*source.m_width * 9];
+        float* destPixel1 = &outPixels[y*source.m_width * 9 + source.m_width * 3];
+        float* destPixel2 = &outPixels[y*source.m_width * 9 + source.m_width * 6];
+        for (int x = 0; x < source.m_width; ++x)
+        {
+            if (mask.Get(x, y))
+            {
+                destPixel0[0] = sourcePixel0[0];
+                destPixel0[1] = sourcePixel0[1];
+                destPixel0[2] = sourcePixel0[2];
+
+                destPixel1[0] = (LoadValue(sourcePixel1[0]) * 0.5f) + 0.5f;
+                destPixel1[1] = (LoadValue(sourcePixel1[1]) * 0.5f) + 0.5f;
+                destPixel1[2] = (LoadValue(sourcePixel1[2]) * 0.5f) + 0.5f;
+
+                destPixel2[0] = (LoadValue(sourcePixel1[3]) * 0.5f) + 0.5f;
+                destPixel2[1] = (LoadValue(sourcePixel1[4]) * 0.5f) + 0.5f;
+                destPixel2[2] = (LoadValue(sourcePixel1[5]) * 0.5f) + 0.5f;
+            }
+            else
+            {
+                memset(destPixel0, 0, sizeof(float) * 3);
+                memset(destPixel1, 0, sizeof(float) * 3);
+                memset(destPixel2, 0, sizeof(float) * 3);
+            }
+
+            // move to the next pixels
+            destPixel0 += 3;
+            destPixel1 += 3;
+            destPixel2 += 3;
+            sourcePixel0 += 3;
+            sourcePixel1 += 6;
+        }
+    }
+
+    // save the file
+    if (!WriteImage(fileName, source.m_width*3, source.m_height, source.m_channels, &outPixels[0]))
+        printf(__FUNCTION__ "() error: Could not write %s\n", fileName);
+}
+
+bool Trim(SImageInfo& source, SBitMask& mask, int& pasteX, int& pasteY, size_t& numMaskPixels, size_t& numBorderPixels, std::vector<int32_t>& pixelIndexToMatrixColumn)
+{
+    // Returns false, leaving the source and mask as they are, if the mask has nothing to trim to.
+    // Find the minimum bounding box based on the mask, looking at whole words of it at once
+    SRect bb;
+    {
+        bb.x1 = mask.m_width;
+        bb.y1 = mask.m_height;
+        bb.x2 = 0;
+        bb.y2 = 0;
+        for (int y = 0; y < mask.m_height; ++y)
+        {
+            const uint64_t* row = mask.GetRow(y);
+            int first = FindNextBit(row, 0, mask.m_width, true);
+            if (first >= mask.m_width)
+                continue;
+
+            size_t lastWord = mask.m_rowWords - 1;
+            while (row[lastWord] == 0)
+                lastWord--;
+
+            bb.x1 = std::min(first, bb.x1);
+            bb.y1 = std::min(y, bb.y1);
+            bb.x2 = std::max(int(lastWord * 64) + HighestSetBit(row[lastWord]), bb.x2);
+            bb.y2 = std::max(y, bb.y2);
+        }
+    }
+
+    // a mask with nothing on, or that's only one pixel across, has nothing inside its border
+    numMaskPixels = 0;
+    numBorderPixels = 0;
+    if (bb.x2 <= bb.x1 || bb.y2 <= bb.y1)
+        return false;
+
+    // make a trimmed mask, shifting the bits of each row down so the row starts at bb.x1
+    {
+        SBitMask newMask;
+        newMask.Allocate(bb.x2 - bb.x1, bb.y2 - bb.y1);
+        const size_t firstWord = size_t(bb.x1) / 64;
+        const int shift = bb.x1 % 64;
+        for (int y = 0; y < newMask.m_height; ++y)
+        {
+            const uint64_t* sourceRow = mask.GetRow(bb.y1 + y);
+            uint64_t* destRow = newMask.GetRow(y);
+            for (size_t word = 0; word < newMask.m_rowWords; ++word)
+            {
+                uint64_t bits = sourceRow[firstWord + word] >> shift;
+                if (shift != 0 && firstWord + word + 1 < mask.m_rowWords)
+                    bits |= sourceRow[firstWord + word + 1] << (64 - shift);
+                destRow[word] = bits;
+            }
+
+            if (newMask.m_width % 64 != 0)
+                destRow[newMask.m_rowWords - 1] &= (1ull << (newMask.m_width % 64)) - 1;
+        }
+
+        mask = std::move(newMask);
+    }
+
+    // make a trimmed source image
+    {
+        SImageInfo newSource;
+        newSource.m_channels = source.m_channels;
+        newSource.m_width = bb.x2 - bb.x1;
+        newSource.m_height = bb.y2 - bb.y1;
+        newSource.m_pixels.resize(newSource.m_width*newSource.m_height*newSource.m_channels);
+
+        for (int y = 0; y < newSource.m_height; ++y)
+        {
+            float* sourcePixel = source.GetPixel(bb.x1, bb.y1 + y);
+            float* destPixel = newSource.GetPixel(0, y);
+            memcpy(destPixel, sourcePixel, sizeof(float)*newSource.m_width*newSource.m_channels);
+        }
+
+        source = newSource;
+    }
+
+    // Sort the mask pixels into interior and border pixels, a word at a time, and find the runs of all of them and of each kind.
+    // A pixel is interior if it and its four neighbors are all on, and it isn't in the first row or column, or the last two rows or columns.
+    {
+        std::vector<uint64_t> interior(mask.m_rowWords), border(mask.m_rowWords), interiorColumns(mask.m_rowWords, 0);
+        for (int x = 1; x <= mask.m_width - 3; ++x)
+            interiorColumns[x / 64] |= 1ull << (x % 64);
+
+        for (int y = 0; y < mask.m_height; ++y)
+        {
+            const uint64_t* row = mask.GetRow(y);
+            const bool interiorRow = y >= 1 && y <= mask.m_height - 3;
+            for (size_t word = 0; word < mask.m_rowWords; ++word)
+            {
+                uint64_t bits = row[word];
+                uint64_t interiorBits = 0;
+                if (interiorRow)
+                {
+                    // bit x of left is whether x - 1 is on, and bit x of right is whether x + 1 is on
+                    uint64_t left = (bits << 1) | ((word > 0) ? row[word - 1] >> 63 : 0);
+                    uint64_t right = (bits >> 1) | ((word + 1 < mask.m_rowWords) ? row[word + 1] << 63 : 0);
+                    interiorBits = bits & left & right & mask.GetRow(y - 1)[word] & mask.GetRow(y + 1)[word] & interiorColumns[word];
                 }
+                interior[word] = interiorBits;
+                border[word] = bits & ~interiorBits;
+                numMaskPixels += PopCount(bits);
+                numBorderPixels += PopCount(border[word]);
+            }
+
+            const size_t rowStart = size_t(y) * size_t(mask.m_width);
+            FindBitRuns(row, mask.m_width, rowStart, mask.m_spans);
+            FindBitRuns(&interior[0], mask.m_width, rowStart, mask.m_interiorSpans);
+            FindBitRuns(&border[0], mask.m_width, rowStart, mask.m_borderSpans);
+        }
+    }
+
+    // make the pixelIndexToMatrixColumn index image. Pixels that aren't being solved for are -1.
+    pixelIndexToMatrixColumn.assign(size_t(mask.m_width) * size_t(mask.m_height), -1);
+    int32_t numInteriorPixels = 0;
+    for (const SPixelSpan& span : mask.m_interiorSpans)
+    {
+        for (size_t index = 0; index < span.m_count; ++index)
+            pixelIndexToMatrixColumn[span.m_start + index] = numInteriorPixels++;
+    }
+
+    // adjust the paste location
+    pasteX += bb.x1;
+    pasteY += bb.y1;
+    return true;
+}
+
+template <typename TPrecision>
+void BlendImageWithPrecision (SImageInfo& source, const SBitMask& mask, SImageInfo& dest, int pasteX, int pasteY, const SMaskPlan& plan, const std::vector<int32_t>& pixelIndexToMatrixColumn, bool saveDebugImages)
+{
+    // The solve makes what it needs of the gradient straight from the source image, so the gradient image is only made to save it out
+    if (saveDebugImages)
+    {
+        SStageTimer timer("gradient");
+        std::vector<typename TPrecision::TGradient> sourceGradient;
+        MakeImageGradient(source, mask, dest, pasteX, pasteY, sourceGradient);
+        SaveImageGradient(source, mask, sourceGradient, "out_gradient.png");
+    }
+
+    // Make the right hand side of the solve. It works on one color channel at a time, so it wants a planar copy of the source image.
+    // Nothing uses the interleaved source after that, so it's freed instead of being kept alongside the copy.
+    SBlendInput input;
+    {
+        SStageTimer timer("right hand side");
+        SPlanarImage<typename TPrecision::TImage> planarSource;
+        MakePlanarImage(source, planarSource);
+        source.FreePixels();
+        MakeBlendInput(planarSource, mask, dest, pasteX, pasteY, plan, pixelIndexToMatrixColumn, input);
+    }
+
+    // Do a poisson blend
+    SStageTimer timer("solve");
+    PoissonBlend(mask, dest, pasteX, pasteY, plan, pixelIndexToMatrixColumn, input);
+}
+
+void BlendImage (SImageInfo& source, SBitMask& mask, SImageInfo& dest, SEncodedImage& encodedDest, int pasteX, int pasteY, const char* planCacheDirectory, bool saveDebugImages)
+{
+    // Poisson blends the source into the destination image in place. The source and mask are trimmed along the way.
+    // The encoded destination is brought up to date, which only encodes the area the blend changed once it has been fully encoded.
+    // Each stage is added to the current job of g_report.
+
+    // Trim the source and mask to a bounding rectangle
+    std::vector<int32_t> pixelIndexToMatrixColumn;
+    size_t numMaskPixels = 0;
+    size_t numBorderPixels = 0;
+    bool trimmed = false;
+    {
+        SStageTimer timer("trim");
+        trimmed = Trim(source, mask, pasteX, pasteY, numMaskPixels, numBorderPixels, pixelIndexToMatrixColumn);
+    }
+
+    // if every pixel of the mask is on its border, the blend leaves the destination as it is
+    if (!trimmed || numMaskPixels == numBorderPixels)
+    {
+        printf("The mask has no pixels inside its border, so there is nothing to blend\n");
+        SStageTimer timer("encode");
+        EncodeImage(dest, encodedDest);
+        return;
+    }
+
+    // do a naive paste onto a copy of the destination and save it out. It's pasted onto the encoded destination, so that needs to be up to date first.
+    if (saveDebugImages)
+    {
+        SStageTimer timer("naive paste");
+        EncodeImage(dest, encodedDest);
+        SEncodedImage naivePaste = encodedDest;
+        NaivePaste(source, mask, naivePaste, pasteX, pasteY);
+        if (!WriteImage("out_paste_naive.png", naivePaste))
+            printf("Could not write out_paste_naive.png\n");
+    }
+
+    // Get the plan for solving with this mask. It only depends on the mask, so it may already be cached.
+    // The number of pixels we actually need to solve for is the number of "on" pixels in the mask, minus any pixels that are on the border of that mask, since they are boundary conditions
+    const SMaskPlan* plan = nullptr;
+    {
+        SStageTimer timer("plan");
+        plan = &GetMaskPlan(mask, numMaskPixels - numBorderPixels, pixelIndexToMatrixColumn, planCacheDirectory);
+    }
+
+    // the source image and its gradient are stored at the precision asked for
+    switch (g_precision)
+    {
+        case EPrecision::Float: BlendImageWithPrecision<SFloatPrecision>(source, mask, dest, pasteX, pasteY, *plan, pixelIndexToMatrixColumn, saveDebugImages); break;
+        case EPrecision::Half: BlendImageWithPrecision<SHalfPrecision>(source, mask, dest, pasteX, pasteY, *plan, pixelIndexToMatrixColumn, saveDebugImages); break;
+        case EPrecision::Fixed16: BlendImageWithPrecision<SFixed16Precision>(source, mask, dest, pasteX, pasteY, *plan, pixelIndexToMatrixColumn, saveDebugImages); break;
+    }
+
+    SStageTimer timer("encode");
+    EncodeImage(dest, encodedDest);
+}
+
+struct SBatchJob
+{
+    // a line of a job file, and where it was, for messages about it
+    std::string m_source;
+    std::string m_mask;
+    int m_pasteX = 0;
+    int m_pasteY = 0;
+    int m_lineNumber = 0;
+};
+
+int ReadBatchJobs (const char* jobFileName, std::vector<SBatchJob>& jobs)
+{
+    // Each line of the job file is <source> <mask> <x> <y>. Blank lines and lines starting with # are skipped. A job file name of - reads the jobs from stdin.
+    // Every line is read, and every source and mask is checked to be there, before any job is blended, so a mistake in the job file doesn't waste a long run.
+    FILE* file = strcmp(jobFileName, "-") ? fopen(jobFileName, "rt") : stdin;
+    if (!file)
+    {
+        printf("Could not open job file %s\n", jobFileName);
+        return 2;
+    }
+
+    int ret = 0;
+    int lineNumber = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), file))
+    {
+        ++lineNumber;
+        const char* text = line;
+        while (*text == ' ' || *text == '\t')
+            ++text;
+        if (*text == '#' || *text == '\n' || *text == '\r' || *text == 0)
+            continue;
+
+        char sourceFileName[1024], maskFileName[1024];
+        SBatchJob job;
+        if (sscanf(text, "%1023s %1023s %i %i", sourceFileName, maskFileName, &job.m_pasteX, &job.m_pasteY) != 4)
+        {
+            printf("%s(%i): expected <source> <mask> <x> <y>\n", jobFileName, lineNumber);
+            ret = std::max(ret, 3);
+            continue;
+        }
+
+        int64_t size, modifiedTime;
+        for (const char* fileName : { sourceFileName, maskFileName })
+        {
+            if (!GetFileSizeAndTime(fileName, size, modifiedTime))
+            {
+                printf("%s(%i): Could not find %s\n", jobFileName, lineNumber, fileName);
+                ret = std::max(ret, 2);
             }
         }
+
+        job.m_source = sourceFileName;
+        job.m_mask = maskFileName;
+        job.m_lineNumber = lineNumber;
+        jobs.push_back(job);
+    }
+
+    if (file != stdin)
+        fclose(file);
+    return ret;
+}
+
+int RunBatch (const char* jobFileName, const std::vector<SBatchJob>& jobs, SImageInfo& dest, SEncodedImage& encodedDest, const char* planCacheDirectory, const char* imageCacheDirectory)
+{
+    // The jobs are blended onto the destination in order, so later pastes go over earlier ones. Returns how many of them failed.
+    // A job that fails, because its images can't be decoded or don't match in size, is skipped and marked failed in the report,
+    // and the rest go ahead, so one bad sprite doesn't lose all of the others.
+    int numFailedJobs = 0;
+    for (const SBatchJob& job : jobs)
+    {
+        g_report.BeginJob(job.m_source.c_str(), job.m_mask.c_str(), job.m_pasteX, job.m_pasteY);
+        SImageInfo source;
+        SBitMask mask;
+        bool loaded = false;
+        {
+            SStageTimer timer("load");
+            loaded = LoadImageFile(source, job.m_source.c_str(), 3, imageCacheDirectory) && LoadMaskFile(mask, job.m_mask.c_str(), imageCacheDirectory);
+        }
+
+        if (loaded && (source.m_width != mask.m_width || source.m_height != mask.m_height))
+        {
+            printf("%s(%i): Source and mask must be same dimensions\n", jobFileName, job.m_lineNumber);
+            loaded = false;
+        }
+
+        if (!loaded)
+        {
+            printf("%s(%i): skipped\n", jobFileName, job.m_lineNumber);
+            numFailedJobs++;
+            g_report.EndJob(false);
+            continue;
+        }
+
+        BlendImage(source, mask, dest, encodedDest, job.m_pasteX, job.m_pasteY, planCacheDirectory, false);
+        g_report.EndJob(true);
+    }
+    return numFailedJobs;
+}
+
+void WriteJsonString (FILE* file, const char* text)
+{
+    fputc('"', file);
+    for (; *text; ++text)
+    {
+        if (*text == '"' || *text == '\\')
+            fprintf(file, "\\%c", *text);
+        else if ((unsigned char)*text < 0x20)
+            fprintf(file, "\\u%04x", (unsigned char)*text);
+        else
+            fputc(*text, file);
     }
+    fputc('"', file);
 }
 
-void MatrixMultiply (const std::vector<float>& matrix, const std::vector<float>& inputVector, std::vector<float>& outputVector)
+void WriteJsonStages (FILE* file, const std::vector<SStageReport>& stages, const char* indent)
 {
-    size_t size = inputVector.size();
-    
-    assert(matrix.size() == size * size);
-    
-    outputVector.resize(inputVector.size());
-
-    for (size_t column = 0; column < size; ++column)
+    if (stages.empty())
     {
-        outputVector[column] = 0;
+        fprintf(file, "[]");
+        return;
+    }
 
-        for (size_t index = 0; index < size; ++index)
-        {
-            outputVector[column] += inputVector[index] * matrix[column * size + index];
-        }
+    fprintf(file, "[");
+    for (size_t index = 0; index < stages.size(); ++index)
+    {
+        const SStageReport& stage = stages[index];
+        fprintf(file, "%s\n%s  { \"name\": ", index ? "," : "", indent);
+        WriteJsonString(file, stage.m_name);
+        fprintf(file, ", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"bytes_allocated\": %llu, \"allocations\": %llu, \"peak_rss_bytes\": %llu }",
+            stage.m_usage.m_wallSeconds, stage.m_usage.m_cpuSeconds, (unsigned long long)stage.m_usage.m_bytesAllocated,
+            (unsigned long long)stage.m_usage.m_allocations, (unsigned long long)stage.m_usage.m_peakResidentBytes);
     }
+    fprintf(file, "\n%s]", indent);
 }
 
-void PoissonBlend (const SImageInfo& source, const std::vector<float> sourceGradient, const SImageInfo& mask, SImageInfo& dest, int pasteX, int pasteY, size_t numMaskPixels, size_t numBorderPixels, std::unordered_map<size_t, size_t>& pixelIndexToMatrixColumn, const char* fileName)
+void WriteJsonSolveProgress (FILE* file, const SSolveProgress& progress)
 {
-    // calculate how many pixels we actually need to solve for. It's the number of "on" pixels in the mask, minus any pixels that are on the border of that mask, since they are boundary conditions
-    size_t numSolvePixels = numMaskPixels - numBorderPixels;
+    // written on one line, so it can also be a line of the solve log
+    fprintf(file, "{ \"solver\": \"%s\", ", progress.m_solver);
+    if (progress.m_channel >= 0)
+        fprintf(file, "\"channel\": %i, ", progress.m_channel);
+    fprintf(file, "\"iterations\": %i, \"relative_residual\": [", progress.m_iteration);
+    for (int index = 0; index < progress.m_numChannels; ++index)
+        fprintf(file, "%s%.9g", index ? ", " : "", progress.m_relativeResidual[index]);
+    fprintf(file, "]");
+    if (progress.m_finished)
+        fprintf(file, ", \"stop\": \"%s\"", c_solveStopNames[int(progress.m_stop)]);
+    fprintf(file, " }");
+}
 
-    // allocate space for our matrix and the inverted matrix
-    std::vector<float> matrix;
-    matrix.resize(numSolvePixels*numSolvePixels, 0.0f);
+bool WriteReport (const SReport& report, const char* fileName, int exitCode)
+{
+    // Writes the stages of every job as JSON, along with the settings that affect how long they take and whether the run succeeded.
+    // Peak resident sizes are for the whole process, so they only ever go up.
+    FILE* file = fopen(fileName, "wt");
+    if (!file)
+        return false;
 
-    // fill in the rows of the matrix with the constraints about the value of pixels
-    size_t matrixRowBegin = 0;
-    size_t pixelIndex = -1;
-    for (size_t y = 0; y < mask.m_height; ++y)
+    const char* precisionName = (g_precision == EPrecision::Half) ? "half" : (g_precision == EPrecision::Fixed16) ? "fixed16" : "float";
+    fprintf(file, "{\n  \"status\": \"%s\",\n  \"exit_code\": %i,\n", exitCode ? "failed" : "succeeded", exitCode);
+    fprintf(file, "  \"solver\": \"%s\",\n  \"kernels\": \"%s\",\n  \"precision\": \"%s\",\n  \"threads\": %i,\n",
+        c_solverNames[int(g_solver)], g_stencilKernels.m_name, precisionName, g_threadPool.NumThreads());
+    fprintf(file, "  \"tolerance\": %g,\n  \"max_iterations\": %i,\n", double(g_solveControl.m_tolerance), g_solveControl.m_maxIterations);
+    fprintf(file, "  \"stages\": ");
+    WriteJsonStages(file, report.m_stages, "  ");
+    fprintf(file, ",\n  \"jobs\": [");
+    for (size_t index = 0; index < report.m_jobs.size(); ++index)
     {
-        for (size_t x = 0; x < mask.m_width; ++x)
+        const SJobReport& job = report.m_jobs[index];
+        fprintf(file, "%s\n    {\n      \"source\": ", index ? "," : "");
+        WriteJsonString(file, job.m_source.c_str());
+        fprintf(file, ",\n      \"mask\": ");
+        WriteJsonString(file, job.m_mask.c_str());
+        fprintf(file, ",\n      \"x\": %i,\n      \"y\": %i,\n      \"status\": \"%s\",\n      \"stages\": ", job.m_pasteX, job.m_pasteY, job.m_succeeded ? "succeeded" : "failed");
+        WriteJsonStages(file, job.m_stages, "      ");
+        fprintf(file, ",\n      \"solves\": [");
+        for (size_t solveIndex = 0; solveIndex < job.m_solves.size(); ++solveIndex)
         {
-            ++pixelIndex;
-
-            // skip all pixels that don't show up in the matrix. That means they don't need to be solved for.
-            size_t matrixColumn = pixelIndexToMatrixColumn[pixelIndex];
-            if (matrixColumn == -1)
-                continue;
+            fprintf(file, "%s\n        ", solveIndex ? "," : "");
+            WriteJsonSolveProgress(file, job.m_solves[solveIndex]);
+        }
+        fprintf(file, job.m_solves.empty() ? "]\n    }" : "\n      ]\n    }");
+    }
+    fprintf(file, report.m_jobs.empty() ? "]\n}\n" : "\n  ]\n}\n");
 
-            // figure out what matrix columns our neighbors belong in
-            size_t pixelIndexLeft = (y*mask.m_width) + (x - 1);
-            size_t pixelIndexRight = (y*mask.m_width) + (x + 1);
-            size_t pixelIndexUp = ((y - 1)*mask.m_width) + x;
-            size_t pixelIndexDown = ((y + 1)*mask.m_width) + x;
+    bool success = !ferror(file);
+    return (fclose(file) == 0) && success;
+}
 
-            size_t matrixColumnLeft = pixelIndexToMatrixColumn[pixelIndexLeft];
-            size_t matrixColumnRight = pixelIndexToMatrixColumn[pixelIndexRight];
-            size_t matrixColumnUp = pixelIndexToMatrixColumn[pixelIndexUp];
-            size_t matrixColumnDown = pixelIndexToMatrixColumn[pixelIndexDown];
+enum class EBenchStage
+{
+    Load,
+    Trim,
+    NaivePaste,
+    Plan,
+    RightHandSide,
+    Solve,
+    Write,
+    Count
+};
+const char* c_benchStageNames[] = { "load", "trim", "naive paste", "plan", "rhs", "solve", "write" };
 
-            // write the values into the matrix row
-            matrix[matrixRowBegin + matrixColumn] = 4.0f;
+bool WriteBenchImages (int size, const char* sourceFileName, const char* maskFileName, SImageInfo& dest)
+{
+    // The source is smooth color with some noise on it, so its PNG file isn't unusually easy to compress or decode. The mask is a disc that fills it.
+    // The destination is made in memory, since it's loaded once per job, rather than once per blend.
+    std::vector<float> source(size_t(size) * size_t(size) * 3), mask(size_t(size) * size_t(size));
+    const float center = float(size - 1) * 0.5f;
+    const float radius = float(size) * 0.5f - 1.0f;
+    for (int y = 0; y < size; ++y)
+    {
+        for (int x = 0; x < size; ++x)
+        {
+            const size_t pixelIndex = size_t(y) * size_t(size) + size_t(x);
+            const float noise = float((uint32_t(x) * 73856093u ^ uint32_t(y) * 19349663u) % 256u) / 2550.0f;
+            for (int channel = 0; channel < 3; ++channel)
+                source[pixelIndex * 3 + channel] = 0.45f + 0.4f * std::sin(float(x) * 0.05f + float(channel) * 2.0f) * std::cos(float(y) * 0.03f) + noise;
+            const float dx = float(x) - center;
+            const float dy = float(y) - center;
+            mask[pixelIndex] = (dx * dx + dy * dy <= radius * radius) ? 1.0f : 0.0f;
+        }
+    }
 
-            if (matrixColumnLeft != -1)
-                matrix[matrixRowBegin + matrixColumnLeft] = -1.0f;
+    dest.m_width = size + c_benchMargin * 2;
+    dest.m_height = size + c_benchMargin * 2;
+    dest.m_channels = 3;
+    dest.Allocate(EImageLayout::Interleaved);
+    for (int y = 0; y < dest.m_height; ++y)
+    {
+        for (int x = 0; x < dest.m_width; ++x)
+        {
+            for (int channel = 0; channel < 3; ++channel)
+                dest.m_pixels[dest.PixelOffset(x, y, channel)] = 0.5f + 0.4f * std::cos(float(x + y) * 0.02f + float(channel));
+        }
+    }
 
-            if (matrixColumnRight != -1)
-                matrix[matrixRowBegin + matrixColumnRight] = -1.0f;
+    return WriteImage(sourceFileName, size, size, 3, &source[0]) && WriteImage(maskFileName, size, size, 1, &mask[0]);
+}
 
-            if (matrixColumnUp != -1)
-                matrix[matrixRowBegin + matrixColumnUp] = -1.0f;
+template <typename TPrecision>
+bool RunBenchStages (const char* sourceFileName, const char* maskFileName, const char* outFileName, const SImageInfo& benchDest, double (&seconds)[int(EBenchStage::Count)])
+{
+    // Runs every stage of a blend the way BlendImage does, timing each one. The mask plan is always made, instead of coming from the cache.
+    // Copying the destination and bringing its encoded image up to date are done outside of the timings, since a job file only does that once.
+    SImageInfo source, dest = benchDest;
+    SBitMask mask;
+    SEncodedImage encodedDest;
+    EncodeImage(dest, encodedDest);
+    SEncodedImage naivePaste = encodedDest;
+    int pasteX = c_benchMargin;
+    int pasteY = c_benchMargin;
 
-            if (matrixColumnDown != -1)
-                matrix[matrixRowBegin + matrixColumnDown] = -1.0f;
+    SStopwatch stopwatch;
+    if (!LoadImageFile(source, sourceFileName, 3, nullptr) || !LoadMaskFile(mask, maskFileName, nullptr))
+        return false;
+    seconds[int(EBenchStage::Load)] = stopwatch.Lap();
 
-            // we've used this matrix row, so move down to the next
-            matrixRowBegin += numSolvePixels;
-        }
-    }
+    std::vector<int32_t> pixelIndexToMatrixColumn;
+    size_t numMaskPixels = 0;
+    size_t numBorderPixels = 0;
+    Trim(source, mask, pasteX, pasteY, numMaskPixels, numBorderPixels, pixelIndexToMatrixColumn);
+    seconds[int(EBenchStage::Trim)] = stopwatch.Lap();
 
-    // invert the matrix
-    std::vector<float> matrixInverted;
-    InvertMatrixDestructive(numSolvePixels, matrix, matrixInverted);
+    NaivePaste(source, mask, naivePaste, pasteX, pasteY);
+    seconds[int(EBenchStage::NaivePaste)] = stopwatch.Lap();
 
-    // now that we have the inverted matrix, we can use it to solve our desired derivative and boundary conditions for each color channel
+    SMaskPlan plan;
+    MakeMaskPlan(mask, numMaskPixels - numBorderPixels, pixelIndexToMatrixColumn, GetSolver(mask), plan);
+    seconds[int(EBenchStage::Plan)] = stopwatch.Lap();
 
-    // make the input vectors
-    // fill in the rows of the matrix with the constraints about the value of pixels
-    std::vector<float> inputVectorR, inputVectorG, inputVectorB;
-    inputVectorR.resize(numSolvePixels, 0.0f);
-    inputVectorG.resize(numSolvePixels, 0.0f);
-    inputVectorB.resize(numSolvePixels, 0.0f);
-    pixelIndex = -1;
-    for (size_t y = 0; y < mask.m_height; ++y)
+    SBlendInput input;
     {
-        for (size_t x = 0; x < mask.m_width; ++x)
-        {
-            ++pixelIndex;
-
-            // skip all pixels that don't show up in the matrix. That means they don't need to be solved for.
-            size_t matrixColumn = pixelIndexToMatrixColumn[pixelIndex];
-            if (matrixColumn == -1)
-                continue;
-
-            // figure out what matrix columns our neighbors belong in
-            size_t pixelIndexLeft = (y*mask.m_width) + (x - 1);
-            size_t pixelIndexRight = (y*mask.m_width) + (x + 1);
-            size_t pixelIndexUp = ((y - 1)*mask.m_width) + x;
-            size_t pixelIndexDown = ((y + 1)*mask.m_width) + x;
+        SPlanarImage<typename TPrecision::TImage> planarSource;
+        MakePlanarImage(source, planarSource);
+        source.FreePixels();
+        MakeBlendInput(planarSource, mask, dest, pasteX, pasteY, plan, pixelIndexToMatrixColumn, input);
+    }
+    seconds[int(EBenchStage::RightHandSide)] = stopwatch.Lap();
 
-            size_t matrixColumnLeft = pixelIndexToMatrixColumn[pixelIndexLeft];
-            size_t matrixColumnRight = pixelIndexToMatrixColumn[pixelIndexRight];
-            size_t matrixColumnUp = pixelIndexToMatrixColumn[pixelIndexUp];
-            size_t matrixColumnDown = pixelIndexToMatrixColumn[pixelIndexDown];
+    PoissonBlend(mask, dest, pasteX, pasteY, plan, pixelIndexToMatrixColumn, input);
+    seconds[int(EBenchStage::Solve)] = stopwatch.Lap();
 
-            // input vector is the sum of the gradients but the gradients from the pixel FORWARD are negative.
-            // This is just because of how we set up the equation for each line:
-            // 4 * Pixel - Left - Right - Up - Down = DeltaLeft - DeltaRight + DeltaUp - DeltaDown
-            // there are other ways we could have set up each equation (line) that are equivelant
-            inputVectorR[matrixColumn] = 0.0f
-                + sourceGradient[((y + 0) * mask.m_width + x + 0) * 6 + 0 + 0]
-                - sourceGradient[((y + 0) * mask.m_width + x + 1) * 6 + 0 + 0]
-                + sourceGradient[((y + 0) * mask.m_width + x + 0) * 6 + 3 + 0]
-                - sourceGradient[((y + 1) * mask.m_width + x + 0) * 6 + 3 + 0];
+    EncodeImage(dest, encodedDest);
+    if (!WriteImage(outFileName, encodedDest))
+        return false;
+    seconds[int(EBenchStage::Write)] = stopwatch.Lap();
+    return true;
+}
 
-            inputVectorG[matrixColumn] = 0.0f
-                + sourceGradient[((y + 0) * mask.m_width + x + 0) * 6 + 0 + 1]
-                - sourceGradient[((y + 0) * mask.m_width + x + 1) * 6 + 0 + 1]
-                + sourceGradient[((y + 0) * mask.m_width + x + 0) * 6 + 3 + 1]
-                - sourceGradient[((y + 1) * mask.m_width + x + 0) * 6 + 3 + 1];
+int RunBenchmark (int maxSize)
+{
+    // Times each stage of a blend at every mask size, with whatever options were given. ns/pixel and Mpixels/s are per pixel of the size x size source.
+    // The rhs stage makes the planar copy of the source and the right hand side from it. The write includes encoding the part of the destination the blend changed.
+    char sourceFileName[1024], maskFileName[1024], outFileName[1024];
+    snprintf(sourceFileName, sizeof(sourceFileName), "%s/bench_source.png", g_scratchDirectory);
+    snprintf(maskFileName, sizeof(maskFileName), "%s/bench_mask.png", g_scratchDirectory);
+    snprintf(outFileName, sizeof(outFileName), "%s/bench_out.png", g_scratchDirectory);
 
-            inputVectorB[matrixColumn] = 0.0f
-                + sourceGradient[((y + 0) * mask.m_width + x + 0) * 6 + 0 + 2]
-                - sourceGradient[((y + 0) * mask.m_width + x + 1) * 6 + 0 + 2]
-                + sourceGradient[((y + 0) * mask.m_width + x + 0) * 6 + 3 + 2]
-                - sourceGradient[((y + 1) * mask.m_width + x + 0) * 6 + 3 + 2];
+    const char* precisionName = (g_precision == EPrecision::Half) ? "half" : (g_precision == EPrecision::Fixed16) ? "fixed16" : "float";
+    printf("solver %s, kernels %s, precision %s, %i threads\n", c_solverNames[int(g_solver)], g_stencilKernels.m_name, precisionName, g_threadPool.NumThreads());
+    printf("%6s  %-12s %12s %12s %12s\n", "size", "stage", "ms", "ns/pixel", "Mpixels/s");
 
-            // Anything which has a negative matrix index is a boundary condition pixel and must be ADDED to the right side of the equation (aka the input vector!) from the source image.
-            if (matrixColumnLeft == -1)
-            {
-                inputVectorR[matrixColumn] += source.m_pixels[pixelIndexLeft * 3 + 0];
-                inputVectorG[matrixColumn] += source.m_pixels[pixelIndexLeft * 3 + 1];
-                inputVectorB[matrixColumn] += source.m_pixels[pixelIndexLeft * 3 + 2];
-            }
+    int ret = 0;
+    for (int size = c_benchMinSize; size <= maxSize && ret == 0; size *= 2)
+    {
+        SImageInfo dest;
+        if (!WriteBenchImages(size, sourceFileName, maskFileName, dest))
+        {
+            printf("Could not write the benchmark images to %s\n", g_scratchDirectory);
+            ret = 5;
+            break;
+        }
 
-            if (matrixColumnRight == -1)
+        double best[int(EBenchStage::Count)] = {};
+        double totalSeconds = 0.0;
+        for (int run = 0; run < c_benchMaxRuns && (run == 0 || totalSeconds < c_benchMinSeconds); ++run)
+        {
+            double seconds[int(EBenchStage::Count)] = {};
+            bool success = false;
+            switch (g_precision)
             {
-                inputVectorR[matrixColumn] += source.m_pixels[pixelIndexRight * 3 + 0];
-                inputVectorG[matrixColumn] += source.m_pixels[pixelIndexRight * 3 + 1];
-                inputVectorB[matrixColumn] += source.m_pixels[pixelIndexRight * 3 + 2];
+                case EPrecision::Float: success = RunBenchStages<SFloatPrecision>(sourceFileName, maskFileName, outFileName, dest, seconds); break;
+                case EPrecision::Half: success = RunBenchStages<SHalfPrecision>(sourceFileName, maskFileName, outFileName, dest, seconds); break;
+                case EPrecision::Fixed16: success = RunBenchStages<SFixed16Precision>(sourceFileName, maskFileName, outFileName, dest, seconds); break;
             }
-
-            if (matrixColumnUp == -1)
+            if (!success)
             {
-                inputVectorR[matrixColumn] += source.m_pixels[pixelIndexUp * 3 + 0];
-                inputVectorG[matrixColumn] += source.m_pixels[pixelIndexUp * 3 + 1];
-                inputVectorB[matrixColumn] += source.m_pixels[pixelIndexUp * 3 + 2];
+                printf("Could not run the benchmark at size %i\n", size);
+                ret = 5;
+                break;
             }
 
-            if (matrixColumnDown != -1)
+            for (int stage = 0; stage < int(EBenchStage::Count); ++stage)
             {
-                inputVectorR[matrixColumn] += source.m_pixels[pixelIndexDown * 3 + 0];
-                inputVectorG[matrixColumn] += source.m_pixels[pixelIndexDown * 3 + 1];
-                inputVectorB[matrixColumn] += source.m_pixels[pixelIndexDown * 3 + 2];
+                best[stage] = (run == 0) ? seconds[stage] : std::min(best[stage], seconds[stage]);
+                totalSeconds += seconds[stage];
             }
         }
-    }
 
-    // multiply the input matrices by the matrix to get the solution
-    std::vector<float> outputVectorR, outputVectorG, outputVectorB;
+        if (ret != 0)
+            break;
 
-    // multiply vectors by matrix to get result
-    MatrixMultiply(matrixInverted, inputVectorR, outputVectorR);
-    MatrixMultiply(matrixInverted, inputVectorG, outputVectorG);
-    MatrixMultiply(matrixInverted, inputVectorB, outputVectorB);
+        const double numPixels = double(size) * double(size);
+        double bestTotal = 0.0;
+        for (int stage = 0; stage < int(EBenchStage::Count); ++stage)
+            bestTotal += best[stage];
 
-    // turn the solved pixels into an image
-    SImageInfo outPixels;
-    outPixels.m_width = mask.m_width;
-    outPixels.m_height = mask.m_height;
-    outPixels.m_channels = 3;
-    outPixels.m_pixels.resize(outPixels.m_width*outPixels.m_height * outPixels.m_channels);
-    pixelIndex = -1;
-    for (size_t y = 0; y < mask.m_height; ++y)
-    {
-        for (size_t x = 0; x < mask.m_width; ++x)
+        for (int stage = 0; stage <= int(EBenchStage::Count); ++stage)
         {
-            ++pixelIndex;
-            
-            size_t matrixColumn = pixelIndexToMatrixColumn[pixelIndex];
-            if (matrixColumn == -1)
-            {
-                outPixels.m_pixels[pixelIndex * 3 + 0] = 0.0f;
-                outPixels.m_pixels[pixelIndex * 3 + 1] = 0.0f;
-                outPixels.m_pixels[pixelIndex * 3 + 2] = 0.0f;
-                continue;
-            }
-            
-            outPixels.m_pixels[pixelIndex * 3 + 0] = outputVectorR[matrixColumn];
-            outPixels.m_pixels[pixelIndex * 3 + 1] = outputVectorG[matrixColumn];
-            outPixels.m_pixels[pixelIndex * 3 + 2] = outputVectorB[matrixColumn];
+            const bool total = (stage == int(EBenchStage::Count));
+            const double seconds = total ? bestTotal : best[stage];
+            printf("%6i  %-12s %12.3f %12.2f %12.2f\n", size, total ? "total" : c_benchStageNames[stage], seconds * 1000.0, seconds * 1.0e9 / numPixels, numPixels / std::max(seconds, 1.0e-9) / 1.0e6);
         }
     }
 
-    // Do a naive paste of the solved pixels onto the destination image
-    NaivePaste(outPixels, mask, dest, pasteX, pasteY, fileName);
+    remove(sourceFileName);
+    remove(maskFileName);
+    remove(outFileName);
+    return ret;
 }
 
-void MakeImageGradient(const SImageInfo& source, const SImageInfo& mask, std::vector<float>& sourceGradient)
+bool ParseIntOption (const char* option, const char* text, int minValue, int maxValue, int& value)
 {
-    // allocate space for the gradients
-    sourceGradient.resize(source.m_width*source.m_height * 6);
-    std::fill(sourceGradient.begin(), sourceGradient.end(), 0.0f);
-
-    // make the gradients!
-    const float* sourcePixel = &source.m_pixels[0];
-    const float* sourcePixelNextRow = sourcePixel + source.m_width * source.m_channels;
-    const float* sourceMask = &mask.m_pixels[0];
-
-    float* destPixel = &sourceGradient[0];
-    for (int y = 0; y < source.m_height-1; ++y)
+    // value is only changed when text is a whole number from minValue to maxValue
+    int parsed = 0;
+    char extra = 0;
+    if (sscanf(text, "%i%c", &parsed, &extra) != 1 || parsed < minValue || parsed > maxValue)
     {
-        for (int x = 0; x < source.m_width-1; ++x)
-        {
-            if (*sourceMask > 0.0f)
-            {
-                // calculate RGB dfdx
-                destPixel[0] = sourcePixel[3] - sourcePixel[0];
-                destPixel[1] = sourcePixel[4] - sourcePixel[1];
-                destPixel[2] = sourcePixel[5] - sourcePixel[2];
-
-                // calculate RGB dfdy
-                destPixel[3] = sourcePixelNextRow[0] - sourcePixel[0];
-                destPixel[4] = sourcePixelNextRow[1] - sourcePixel[1];
-                destPixel[5] = sourcePixelNextRow[2] - sourcePixel[2];
-            }
-            else
-            {
-                memset(destPixel, 0, sizeof(float) * 6);
-            }
-
-            // move to the next pixels
-            sourcePixel += 3;
-            sourcePixelNextRow += 3;
-            sourceMask += 1;
-            destPixel += 6;
-        }
+        printf("invalid value %s for %s, which must be from %i to %i\n", text, option, minValue, maxValue);
+        return false;
     }
+    value = parsed;
+    return true;
 }
 
-void SaveImageGradient(const SImageInfo& source, const SImageInfo& mask, const std::vector<float>& sourceGradient, const char* fileName)
+int Run (int argc, char** argv)
 {
-    // Save the gradient as a side by side double wide image.
-    // The left side is the x axis partial derivatives, the right side is the y axis.
-    std::vector<float> outPixels;
-    outPixels.resize((source.m_width * 3 * source.m_height) * 3);
+    SImageInfo source, dest, output;
+    SBitMask mask;
+    SEncodedImage encodedDest;
+    int pasteX, pasteY;
+    const char* planCacheDirectory = nullptr;
+    const char* imageCacheDirectory = nullptr;
+    const char* kernels = nullptr;
+    const char* solveLogFileName = nullptr;
+    int numThreads = std::max(int(std::thread::hardware_concurrency()), 1);
 
-    const float* sourcePixel0 = &source.m_pixels[0];
-    const float* sourcePixel1 = &sourceGradient[0];
-    const float* sourceMask = &mask.m_pixels[0];
+    // batch mode has the job file, destination and output file names, instead of the source, mask, destination and paste location.
+    // benchmark mode only has the largest mask size to time.
+    bool batch = argc >= 2 && !strcmp(argv[1], "-batch");
+    bool bench = argc >= 2 && !strcmp(argv[1], "-bench");
+    int firstOption = batch ? 5 : bench ? 3 : 6;
 
-    for (int y = 0; y < source.m_height; ++y)
+    // get parameters and load images
     {
-        float* destPixel0 = &outPixels[y*source.m_width * 9];
-        float* destPixel1 = &outPixels[y*source.m_width * 9 + source.m_width * 3];
-        float* destPixel2 = &outPixels[y*source.m_width * 9 + source.m_width * 6];
-        for (int x = 0; x < source.m_width; ++x)
+        if (argc < firstOption)
         {
-            if (*sourceMask > 0.0f)
-            {
-                destPixel0[0] = sourcePixel0[0];
-                destPixel0[1] = sourcePixel0[1];
-                destPixel0[2] = sourcePixel0[2];
-
-                destPixel1[0] = (sourcePixel1[0] * 0.5f) + 0.5f;
-                destPixel1[1] = (sourcePixel1[1] * 0.5f) + 0.5f;
-                destPixel1[2] = (sourcePixel1[2] * 0.5f) + 0.5f;
+            printf("usage: <source> <mask> <dest> <x> <y> [options]\n");
+            printf("       -batch <jobfile> <dest> <output> [options]\n");
+            printf("       -bench <maxsize> [options]\n");
+            printf("options: [-plancache <directory>] [-imagecache <directory>] [-threads <count>] [-kernels <scalar|avx2|avx512>] [-srgb] [-encode <exact|fast>]\n");
+            printf("         [-pnglevel <0-9>] [-pngfilter <none|sub|up|average|paeth|adaptive>] [-precision <float|half|fixed16>]\n");
+            printf("         [-tilesize <pixels>] [-scratch <directory>] [-guidance <source|mixed>] [-solver <dense|cg|pcg|multigrid|cholesky|sor>]\n");
+            printf("         [-report <file>] [-tolerance <relative residual>] [-maxiterations <count>] [-solvelog <file>]\n");
+            printf("Each line of a job file is <source> <mask> <x> <y>, pasted in order. A job file of - reads from stdin.\n");
+            printf("The benchmark times each stage of a blend for disc masks from %i pixels across up to maxsize, doubling each time.\n", c_benchMinSize);
+            return 1;
+        }
 
-                destPixel2[0] = (sourcePixel1[3] * 0.5f) + 0.5f;
-                destPixel2[1] = (sourcePixel1[4] * 0.5f) + 0.5f;
-                destPixel2[2] = (sourcePixel1[5] * 0.5f) + 0.5f;
+        for (int argIndex = firstOption; argIndex < argc; ++argIndex)
+        {
+            if (!strcmp(argv[argIndex], "-plancache") && argIndex + 1 < argc)
+            {
+                planCacheDirectory = argv[++argIndex];
             }
-            else
+            else if (!strcmp(argv[argIndex], "-imagecache") && argIndex + 1 < argc)
             {
-                memset(destPixel0, 0, sizeof(float) * 3);
-                memset(destPixel1, 0, sizeof(float) * 3);
-                memset(destPixel2, 0, sizeof(float) * 3);
+                imageCacheDirectory = argv[++argIndex];
             }
-
-            // move to the next pixels
-            destPixel0 += 3;
-            destPixel1 += 3;
-            destPixel2 += 3;
-            sourcePixel0 += 3;
-            sourcePixel1 += 6;
-            sourceMask += 1;
-        }
-    }
-
-    // save the file
-    if (!WriteImage(fileName, source.m_width*3, source.m_height, source.m_channels, outPixels))
-        printf(__FUNCTION__ "() error: Could not write %s\n", fileName);
-}
-
-bool IsBorderPixel (SImageInfo& mask, int x,int  y)
-{
-    // returns true if this pixel is on the edge of the mask.
-    // also returns true if it's beyond the mask for whatever that's worth.
-    if (x <= 0 || y <= 0)
-        return true;
-
-    if (x >= mask.m_width - 2 || y >= mask.m_height - 2)
-        return true;
-
-    float* pixel11 = mask.GetPixel(x, y);
-    float* pixel01 = pixel11 - mask.m_channels;
-    float* pixel21 = pixel11 + mask.m_channels;
-    float* pixel10 = pixel11 - mask.m_channels * mask.m_width;
-    float* pixel12 = pixel11 + mask.m_channels * mask.m_width;
-
-    return
-        *pixel11 == 0.0f ||
-        *pixel01 == 0.0f ||
-        *pixel21 == 0.0f ||
-        *pixel10 == 0.0f ||
-        *pixel12 == 0.0f;
-}
-
-void Trim(SImageInfo& source, SImageInfo& mask, int& pasteX, int& pasteY, size_t& numMaskPixels, size_t& numBorderPixels, std::unordered_map<size_t, size_t>& pixelIndexToMatrixColumn)
-{
-    // find the minimum bounding box based on the mask
-    SRect bb;
-    {
-        bb.x1 = mask.m_width;
-        bb.y1 = mask.m_height;
-        bb.x2 = 0;
-        bb.y2 = 0;
-        float *pixel = &mask.m_pixels[0];
-        for (int y = 0; y < mask.m_height; ++y)
-        {
-            for (int x = 0; x < mask.m_width; ++x)
+            else if (!strcmp(argv[argIndex], "-threads") && argIndex + 1 < argc)
+            {
+                ++argIndex;
+                if (!ParseIntOption("-threads", argv[argIndex], 1, c_maxThreads, numThreads))
+                    return 1;
+            }
+            else if (!strcmp(argv[argIndex], "-kernels") && argIndex + 1 < argc)
+            {
+                kernels = argv[++argIndex];
+            }
+            else if (!strcmp(argv[argIndex], "-srgb"))
+            {
+                // use the exact sRGB curve instead of a gamma of c_gamma
+                g_transferFunction = ETransferFunction::SRGB;
+            }
+            else if (!strcmp(argv[argIndex], "-encode") && argIndex + 1 < argc && (!strcmp(argv[argIndex + 1], "exact") || !strcmp(argv[argIndex + 1], "fast")))
+            {
+                g_encodeMode = strcmp(argv[++argIndex], "fast") ? EEncodeMode::Exact : EEncodeMode::Fast;
+            }
+            else if (!strcmp(argv[argIndex], "-precision") && argIndex + 1 < argc && (!strcmp(argv[argIndex + 1], "float") || !strcmp(argv[argIndex + 1], "half") || !strcmp(argv[argIndex + 1], "fixed16")))
+            {
+                ++argIndex;
+                g_precision = !strcmp(argv[argIndex], "half") ? EPrecision::Half : !strcmp(argv[argIndex], "fixed16") ? EPrecision::Fixed16 : EPrecision::Float;
+            }
+            else if (!strcmp(argv[argIndex], "-guidance") && argIndex + 1 < argc && (!strcmp(argv[argIndex + 1], "source") || !strcmp(argv[argIndex + 1], "mixed")))
+            {
+                g_guidance = strcmp(argv[++argIndex], "mixed") ? EGuidance::Source : EGuidance::Mixed;
+            }
+            else if (!strcmp(argv[argIndex], "-pnglevel") && argIndex + 1 < argc)
+            {
+                ++argIndex;
+                if (!ParseIntOption("-pnglevel", argv[argIndex], 0, 9, g_pngLevel))
+                    return 1;
+            }
+            else if (!strcmp(argv[argIndex], "-pngfilter") && argIndex + 1 < argc)
+            {
+                ++argIndex;
+                if (!ParsePngFilter(argv[argIndex], g_pngFilter))
+                    return 1;
+            }
+            else if (!strcmp(argv[argIndex], "-tilesize") && argIndex + 1 < argc)
+            {
+                // a tile size of 0 turns tiles off
+                ++argIndex;
+                if (!ParseIntOption("-tilesize", argv[argIndex], 0, INT_MAX - c_tileCoarseBlock, g_tileSize))
+                    return 1;
+                if (g_tileSize > 0)
+                    g_tileSize = std::max((g_tileSize + c_tileCoarseBlock - 1) / c_tileCoarseBlock * c_tileCoarseBlock, c_tileMinSize);
+            }
+            else if (!strcmp(argv[argIndex], "-scratch") && argIndex + 1 < argc)
+            {
+                g_scratchDirectory = argv[++argIndex];
+            }
+            else if (!strcmp(argv[argIndex], "-solver") && argIndex + 1 < argc && ParseSolver(argv[argIndex + 1], g_solver))
+            {
+                ++argIndex;
+            }
+            else if (!strcmp(argv[argIndex], "-report") && argIndex + 1 < argc)
+            {
+                // write the time and memory each stage of each job took, as JSON. main finds the file name, since it writes the report.
+                ++argIndex;
+            }
+            else if (!strcmp(argv[argIndex], "-tolerance") && argIndex + 1 < argc)
             {
-                if (*pixel > 0.0f)
+                // A looser tolerance is faster, but on big masks it leaves visible error, since it's relative to a right hand side that grows with the mask.
+                // See c_solveTolerance.
+                ++argIndex;
+                float tolerance = 0.0f;
+                char extra = 0;
+                if (sscanf(argv[argIndex], "%f%c", &tolerance, &extra) != 1 || !(tolerance > 0.0f))
                 {
-                    bb.x1 = std::min(x, bb.x1);
-                    bb.y1 = std::min(y, bb.y1);
-                    bb.x2 = std::max(x, bb.x2);
-                    bb.y2 = std::max(y, bb.y2);
+                    printf("invalid value %s for -tolerance, which must be more than 0\n", argv[argIndex]);
+                    return 1;
                 }
-                pixel++;
+                g_solveControl.m_tolerance = tolerance;
+            }
+            else if (!strcmp(argv[argIndex], "-maxiterations") && argIndex + 1 < argc)
+            {
+                // 0 leaves it up to each solver
+                ++argIndex;
+                if (!ParseIntOption("-maxiterations", argv[argIndex], 0, INT_MAX, g_solveControl.m_maxIterations))
+                    return 1;
+            }
+            else if (!strcmp(argv[argIndex], "-solvelog") && argIndex + 1 < argc)
+            {
+                // write the residual every time a solver measures it, as a line of JSON. A file name of - writes to stdout.
+                solveLogFileName = argv[++argIndex];
+            }
+            else
+            {
+                printf("unknown option %s\n", argv[argIndex]);
+                return 1;
             }
         }
-    }
 
-    // make a trimmed mask
-    {
-        SImageInfo newMask;
-        newMask.m_channels = mask.m_channels;
-        newMask.m_width = bb.x2 - bb.x1;
-        newMask.m_height = bb.y2 - bb.y1;
-        newMask.m_pixels.resize(newMask.m_width*newMask.m_height*newMask.m_channels);
+        g_threadPool.Start(numThreads);
+        if (!SelectStencilKernels(kernels))
+            return 1;
 
-        for (int y = 0; y < newMask.m_height; ++y)
+        if (solveLogFileName)
         {
-            float* sourcePixel = mask.GetPixel(bb.x1, bb.y1 + y);
-            float* destPixel = newMask.GetPixel(0, y);
-            memcpy(destPixel, sourcePixel, sizeof(float)*newMask.m_width*newMask.m_channels);
-        }
-
-        mask = newMask;
-    }
+            FILE* solveLog = strcmp(solveLogFileName, "-") ? fopen(solveLogFileName, "wt") : stdout;
+            if (!solveLog)
+            {
+                printf("Could not open %s\n", solveLogFileName);
+                return 2;
+            }
 
-    // make a trimmed source image
-    {
-        SImageInfo newSource;
-        newSource.m_channels = source.m_channels;
-        newSource.m_width = bb.x2 - bb.x1;
-        newSource.m_height = bb.y2 - bb.y1;
-        newSource.m_pixels.resize(newSource.m_width*newSource.m_height*newSource.m_channels);
+            g_solveControl.m_callback = [solveLog] (const SSolveProgress& progress)
+            {
+                WriteJsonSolveProgress(solveLog, progress);
+                fputc('\n', solveLog);
+                return true;
+            };
+        }
 
-        for (int y = 0; y < newSource.m_height; ++y)
+        if (bench)
         {
-            float* sourcePixel = source.GetPixel(bb.x1, bb.y1 + y);
-            float* destPixel = newSource.GetPixel(0, y);
-            memcpy(destPixel, sourcePixel, sizeof(float)*newSource.m_width*newSource.m_channels);
+            int maxSize = 0;
+            if (sscanf(argv[2], "%i", &maxSize) != 1 || maxSize < c_benchMinSize)
+            {
+                printf("The benchmark's largest mask size must be at least %i\n", c_benchMinSize);
+                return 3;
+            }
+            return RunBenchmark(maxSize);
         }
 
-        source = newSource;
-    }
-
-    // make the pixelIndexToMatrixColumn map
-    numMaskPixels = 0;
-    numBorderPixels = 0;
-    size_t numInteriorPixels = 0;
-    {
-        float *pixel = &mask.m_pixels[0];
-        size_t pixelIndex = 0;
-        for (int y = 0; y < mask.m_height; ++y)
+        if (batch)
         {
-            for (int x = 0; x < mask.m_width; ++x)
+            // The whole job file is read and checked before anything else, then the destination is loaded once, every job is blended onto it,
+            // and it's written out once at the end, even if some of the jobs failed. Loading and writing the destination are in the report's stages
+            // that aren't part of a job.
+            std::vector<SBatchJob> jobs;
+            int ret = ReadBatchJobs(argv[2], jobs);
+            if (ret != 0)
+                return ret;
+
             {
-                //bool
-                if (*pixel > 0.0f)
-                {
-                    if (IsBorderPixel(mask, x, y))
-                    {
-                        pixelIndexToMatrixColumn.insert(std::make_pair(pixelIndex, size_t(-1)));
-                        numBorderPixels++;
-                    }
-                    else
-                    {
-                        pixelIndexToMatrixColumn.insert(std::make_pair(pixelIndex, numInteriorPixels));
-                        numInteriorPixels++;
-                    }
+                SStageTimer timer("load");
+                if (!LoadImageFile(dest, argv[3], 3, imageCacheDirectory))
+                    return 2;
+            }
 
-                    numMaskPixels++;
-                }
-                else
+            int numFailedJobs = RunBatch(argv[2], jobs, dest, encodedDest, planCacheDirectory, imageCacheDirectory);
+
+            {
+                SStageTimer timer("write");
+                EncodeImage(dest, encodedDest);
+                if (!WriteImage(argv[4], encodedDest))
                 {
-                    pixelIndexToMatrixColumn.insert(std::make_pair(pixelIndex, size_t(-1)));
+                    printf("Could not write %s\n", argv[4]);
+                    return 5;
                 }
-                pixel++;
-                pixelIndex++;
             }
-        }
-    }
-
-    // adjust the paste location
-    pasteX += bb.x1;
-    pasteY += bb.y1;
-}
-
-int main(int argc, char** argv)
-{
-    SImageInfo source, mask, dest, output;
-    int pasteX, pasteY;
-
-    // get parameters and load images
-    {
-        if (argc < 6)
-        {
-            printf("usage: <source> <mask> <dest> <x> <y>\n");
-            return 1;
-        }
 
-        if (!source.Load(argv[1]) || !mask.Load(argv[2], 1) || !dest.Load(argv[3]))
-        {
-            return 2;
+            if (numFailedJobs > 0)
+            {
+                printf("%i of %i jobs failed and were skipped\n", numFailedJobs, int(jobs.size()));
+                return 6;
+            }
+            return 0;
         }
 
         if (!sscanf(argv[4], "%i", &pasteX) || !sscanf(argv[5], "%i", &pasteY))
@@ -669,6 +5738,14 @@ int main(int argc, char** argv)
             return 3;
         }
 
+        // there's only one job, so loading and writing the destination are part of it
+        g_report.BeginJob(argv[1], argv[2], pasteX, pasteY);
+        SStageTimer timer("load");
+        if (!LoadImageFile(source, argv[1], 3, imageCacheDirectory) || !LoadMaskFile(mask, argv[2], imageCacheDirectory) || !LoadImageFile(dest, argv[3], 3, imageCacheDirectory))
+        {
+            return 2;
+        }
+
         if (source.m_width != mask.m_width || source.m_height != mask.m_height)
         {
             printf("Source and mask must be same dimensions\n");
@@ -676,32 +5753,39 @@ int main(int argc, char** argv)
         }
     }
 
-    // Trim the source and mask to a bounding rectangle
-    std::unordered_map<size_t, size_t> pixelIndexToMatrixColumn;
-    size_t numMaskPixels = 0;
-    size_t numBorderPixels = 0;
-    Trim(source, mask, pasteX, pasteY, numMaskPixels, numBorderPixels, pixelIndexToMatrixColumn);
-
-    // do a naive paste and save it out
-    NaivePaste(source, mask, dest, pasteX, pasteY, "out_paste_naive.png");
-
-    // make the source image gradient and save it out to an image
-    std::vector<float> sourceGradient;
-    MakeImageGradient(source, mask, sourceGradient);
-    SaveImageGradient(source, mask, sourceGradient, "out_gradient.png");
+    // blend, saving out the naive paste and gradient images along the way, then save the result
+    BlendImage(source, mask, dest, encodedDest, pasteX, pasteY, planCacheDirectory, true);
+    {
+        SStageTimer timer("write");
+        if (!WriteImage("out_paste_grad.png", encodedDest))
+            printf("Could not write out_paste_grad.png\n");
+    }
+    g_report.EndJob(true);
+    return 0;
+}
 
-    // Do a poisson blend
-    PoissonBlend(source, sourceGradient, mask, dest, pasteX, pasteY, numMaskPixels, numBorderPixels, pixelIndexToMatrixColumn, "out_paste_grad.png");
+int main(int argc, char** argv)
+{
+    // The report is written however the run ends, so a run that failed on its arguments, a load or a job still leaves one that says so.
+    // -report is looked for before anything else is parsed, so it's found even when an option before it is bad.
+    const char* reportFileName = nullptr;
+    for (int argIndex = 1; argIndex + 1 < argc; ++argIndex)
+    {
+        if (!strcmp(argv[argIndex], "-report"))
+            reportFileName = argv[argIndex + 1];
+    }
 
-    return 0;
+    int ret = Run(argc, argv);
+    g_report.EndJob(ret == 0);
+    if (reportFileName && !WriteReport(g_report, reportFileName, ret))
+        printf("Could not write %s\n", reportFileName);
+    return ret;
 }
 
 /*
 
 TODO:
 
-* instead of using a unordered_map for pixel index to matrix column, since it has ALL possible values in there, use a vector instead...
-
 * likely don't need "numBorderPixels". What you really want i think is "numInteriorPixels"
  * probably don't need to know how many pixels are border pixels then either?
  * likely need a map to make matrix to boundary conditions lookups easier